@@ -8,13 +8,32 @@
 #include <iomanip>
 #include <memory>
 #include "Commands.h"
+#include "signals.h"
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <cstdlib>
+#include <spawn.h>
+#include <errno.h>
+#include <algorithm>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <fstream>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <linux/ioprio.h>
+#include <stdio_ext.h>
 
 using namespace std;
 
 const std::string WHITESPACE = " \n\r\t\f\v";
+// what ends the first word of a line (the command name)
+const std::string WORD_DELIMITERS = WHITESPACE + "<>|&;";
 
 #define DO_SYS(syscall, syscall_name)                  \
   do                                                   \
@@ -25,6 +44,7 @@ const std::string WHITESPACE = " \n\r\t\f\v";
       str_for_perror += syscall_name;                  \
       str_for_perror += " failed";                     \
       perror((char *)str_for_perror.c_str());          \
+      SmallShell::getInstance().SetLastStatus(1);      \
       return;                                          \
     }                                                  \
   } while (0)
@@ -40,38 +60,42 @@ const std::string WHITESPACE = " \n\r\t\f\v";
 #define FUNC_EXIT()
 #endif
 
-bool _isPipeCommand(string cmd_line, string &redirection_type)
+// position of the first c at or after start that is not inside quotes
+size_t _findUnquoted(const string &line, char c, size_t start = 0)
 {
-  std::size_t found1 = cmd_line.find("|");
-  std::size_t found2 = cmd_line.find("|&");
-  if (found1 != std::string::npos && found2 == std::string::npos)
-  {
-    redirection_type = "|";
-    return true;
-  }
-  if (found2 != std::string::npos)
+  char quote = 0;
+  for (size_t i = start; i < line.length(); i++)
   {
-    redirection_type = "|&";
-    return true;
+    if (quote)
+    {
+      if (line[i] == quote)
+        quote = 0;
+    }
+    else if (line[i] == '\'' || line[i] == '"')
+    {
+      quote = line[i];
+    }
+    else if (line[i] == '\\')
+    {
+      i++;
+    }
+    else if (line[i] == c)
+    {
+      return i;
+    }
   }
-  return false;
+  return string::npos;
 }
 
-bool _isRedirectionCommand(string cmd_line, string &pipe_type)
+bool _isPipeCommand(string cmd_line, string &redirection_type)
 {
-  std::size_t found1 = cmd_line.find(">");
-  std::size_t found2 = cmd_line.find(">>");
-  if (found1 != std::string::npos && found2 == std::string::npos)
-  {
-    pipe_type = ">";
-    return true;
-  }
-  if (found2 != std::string::npos)
+  std::size_t found = _findUnquoted(cmd_line, '|');
+  if (found == std::string::npos)
   {
-    pipe_type = ">>";
-    return true;
+    return false;
   }
-  return false;
+  redirection_type = (cmd_line.compare(found, 2, "|&") == 0) ? "|&" : "|";
+  return true;
 }
 
 string _ltrim(const std::string &s)
@@ -91,810 +115,4388 @@ string _trim(const std::string &s)
   return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char *cmd_line, char **args)
+/*----- COMMAND ARGS -----*/
+
+// single pass over one copy of the line: every word is NUL-terminated in
+// place and argv points at the start of each one. a trailing & (the
+// background sign) is not a word, so argv can be exec'ed as is.
+CommandArgs::CommandArgs(const char *cmd_line, CommandArena *arena) : argc(0), arena(arena)
 {
   FUNC_ENTRY()
-  int i = 0;
-  std::istringstream iss(_trim(string(cmd_line)).c_str());
-  for (std::string s; iss >> s;)
+  // a line of n chars has at most (n + 1) / 2 words
+  size_t max_words = (strlen(cmd_line) + 1) / 2 + 1;
+  if (arena)
   {
-    args[i] = (char *)malloc(s.length() + 1);
-    memset(args[i], 0, s.length() + 1);
-    strcpy(args[i], s.c_str());
-    args[++i] = NULL;
+    buffer = arena->copyString(cmd_line);
+    argv = (char **)arena->allocate(max_words * sizeof(char *));
   }
-  return i;
-  FUNC_EXIT()
-}
-
-bool _isBackgroundComamnd(const char *cmd_line)
-{
-  const string str(cmd_line);
-  return str[str.find_last_not_of(WHITESPACE)] == '&';
-}
-
-void _removeBackgroundSign(char *cmd_line)
-{
-  const string str(cmd_line);
-  // find last character other than spaces
-  unsigned int idx = str.find_last_not_of(WHITESPACE);
-  // if all characters are spaces then return
-  if (idx == string::npos)
+  else
   {
-    return;
+    buffer = strdup(cmd_line);
+    argv = new char *[max_words];
   }
-  // if the command line does not end with & then return
-  if (cmd_line[idx] != '&')
+  char *last = buffer + strlen(buffer);
+  while (last > buffer && strchr(WHITESPACE.c_str(), last[-1]))
+    last--;
+  if (last > buffer && last[-1] == '&')
+    last[-1] = '\0';
+  char *pos = buffer;
+  while (true)
   {
-    return;
+    while (*pos && strchr(WHITESPACE.c_str(), *pos))
+      pos++;
+    if (!*pos)
+      break;
+    argv[argc++] = pos;
+    while (*pos && !strchr(WHITESPACE.c_str(), *pos))
+      pos++;
+    if (!*pos)
+      break;
+    *pos++ = '\0';
   }
-  // replace the & (background sign) with space and then remove all tailing spaces.
-  cmd_line[idx] = ' ';
-  // truncate the command line string up to the last non-space character
-  cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+  argv[argc] = NULL;
+  FUNC_EXIT()
 }
 
-Command::Command(const char *cmd_line) : cmd_line(cmd_line), foreground(true) {}
-
-const char *Command::GetCmd_line()
+CommandArgs::~CommandArgs()
 {
-  return cmd_line;
+  if (arena)
+    return;
+  free(buffer);
+  delete[] argv;
 }
 
-bool Command::isForeground(){
-  return foreground;
+int CommandArgs::size()
+{
+  return argc;
 }
 
-void Command::SetForeground(bool fg){
-  foreground = fg;
+char *CommandArgs::operator[](int i)
+{
+  return (i >= 0 && i < size()) ? argv[i] : NULL;
 }
 
-/*----- BUILT IN COMMANDS -----*/
-
-BuiltInCommand::BuiltInCommand(const char *cmd_line) : Command(cmd_line) {}
-
-ChPromptCommand::ChPromptCommand(const char *cmd_line, std::string &prompt) : BuiltInCommand(cmd_line)
+char **CommandArgs::data()
 {
-  char *args[20];
-  _parseCommandLine(cmd_line, args);
-  if (!args[1])
-    prompt = "smash> ";
-  else
-    prompt = string(args[1]) + "> ";
+  return argv;
 }
 
-void ChPromptCommand::execute() {}
+/*----- COMMAND ARENA -----*/
 
-ShowPidCommand::ShowPidCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+CommandArena::CommandArena() : current_block(0), used(0) {}
 
-void ShowPidCommand::execute()
+CommandArena::~CommandArena()
 {
-  SmallShell &smash = SmallShell::getInstance();
-  std::cout << "smash pid is " << smash.GetShellPid() << std::endl;
+  reset();
+  for (auto ir = blocks.begin(); ir != blocks.end(); ++ir)
+    free(*ir);
 }
 
-PwdCommand::PwdCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
-
-void PwdCommand::execute()
+// max_align_t aligned chunks, a block of its own for anything bigger than a block
+void *CommandArena::allocate(size_t size)
 {
-  char *buffer = NULL;
-  string res(getcwd(buffer, 0));
-  if (res == "")
+  const size_t align = alignof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+  while (current_block < blocks.size() && used + size > block_sizes[current_block])
   {
-    perror("smash error: getcwd failed");
+    current_block++;
+    used = 0;
   }
-  std::cout << res << std::endl;
+  if (current_block == blocks.size())
+  {
+    size_t block_size = max(size, (size_t)COMMAND_ARENA_BLOCK_SIZE);
+    char *block = (char *)malloc(block_size);
+    if (!block)
+      throw std::bad_alloc();
+    blocks.push_back(block);
+    block_sizes.push_back(block_size);
+    used = 0;
+  }
+  void *ptr = blocks[current_block] + used;
+  used += size;
+  return ptr;
 }
 
-JobsCommand::JobsCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
-
-void JobsCommand::execute()
+char *CommandArena::copyString(const char *str)
 {
-  SmallShell &smash = SmallShell::getInstance();
-  smash.RemoveFinishedJobs();
-  smash.printJobsList();
+  size_t length = strlen(str) + 1;
+  return (char *)memcpy(allocate(length), str, length);
 }
 
-KillCommand::KillCommand(const char *cmd_line, std::shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
-
-void KillCommand::execute()
+bool CommandArena::owns(const void *ptr)
 {
-  char *args[20];
-  int i = _parseCommandLine(GetCmd_line(), args);
-  if (i != 3)
-  {
-    cerr << "smash error: kill: invalid arguments" << endl;
-    return;
-  }
-  string signal = string(strdup(const_cast<char *>(args[1])));
-  const char* signal_c;
-  if (signal.find("-")== 0) {
-    signal_c = (signal.substr(signal.find("-")+1)).c_str();
-  }
-  else{
-    cerr << "smash error: kill: invalid arguments" << endl;
-    return;
-  }
-  if (atoi(signal_c) == 0 || atoi(args[2]) == 0) {
-    cerr << "smash error: kill: invalid arguments" << endl;
-    return;
-  }
-  shared_ptr<JobsList::JobEntry> curr_job = jobs->getJobById(atoi(args[2]));
-  if (!curr_job)
-  {
-    std::cerr << "smash error: kill: job-id " << args[2] << " does not exist" << std::endl;
-    return;
-  }
-  int signum = atoi(signal_c);
-  DO_SYS(kill(curr_job->GetPid(), signum), "kill");
-  std::cout << "signal number " << signum << " was sent to pid " << curr_job->GetPid() << endl;
-  if (signum == SIGCONT)
+  for (size_t i = 0; i < blocks.size(); i++)
   {
-    curr_job->SetIsStopped(false);
+    if (ptr >= blocks[i] && ptr < blocks[i] + block_sizes[i])
+      return true;
   }
-  if (signum == SIGSTOP)
+  return false;
+}
+
+// destroys the commands (newest first) and keeps only the first block, so a
+// single long line does not keep its memory for the rest of the session
+void CommandArena::reset()
+{
+  for (auto ir = commands.rbegin(); ir != commands.rend(); ++ir)
+    (*ir)->~Command();
+  commands.clear();
+  for (size_t i = 1; i < blocks.size(); i++)
+    free(blocks[i]);
+  if (blocks.size() > 1)
   {
-    curr_job->SetIsStopped(true);
+    blocks.resize(1);
+    block_sizes.resize(1);
   }
+  current_block = 0;
+  used = 0;
 }
 
-CdCommand::CdCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+/*----- REDIRECTIONS -----*/
 
-void CdCommand::execute()
+RedirectionList::~RedirectionList()
 {
-  SmallShell &smash = SmallShell::getInstance();
-  char *args[20];
-  int i = _parseCommandLine(GetCmd_line(), args);
-  if (i == 1)
-    return;
-  if (smash.GetPrev_pwd() == "" && string(args[1]) == "-")
+  for (auto ir = saved_fds.begin(); ir != saved_fds.end(); ++ir)
   {
-    std::cerr << "smash error: cd: OLDPWD not set" << std::endl;
-    return;
+    if (ir->second != -1)
+      close(ir->second);
   }
-  if (i > 2)
-    std::cerr << "smash error: cd: too many arguments" << std::endl;
-  if (i == 2)
+}
+
+// scans the line for redirection operators outside of quotes. an fd number
+// counts only as a word of its own ("2>" but not "a2>"). every operator and
+// its target word is removed from the line, so the rest can be used as is.
+bool RedirectionList::parse(char *cmd_line)
+{
+  char quote = 0;
+  for (size_t i = 0; cmd_line[i]; i++)
   {
-    char *buffer = NULL;
-    std::string temp_prev = smash.GetPrev_pwd();
-    string current_dir = getcwd(buffer, 0);
-    if (current_dir == "")
+    char c = cmd_line[i];
+    if (quote)
     {
-      perror("smash error: getcwd failed");
+      if (c == quote)
+        quote = 0;
+      continue;
     }
-    _removeBackgroundSign(args[1]);
-    // change to previous directory
-    if (string(args[1]) == "-") 
+    if (c == '\\' && cmd_line[i + 1])
     {
-      smash.SetPrev_Pwd(current_dir);
-      DO_SYS(chdir(temp_prev.c_str()), "chdir");
+      i++;
+      continue;
+    }
+    if (c == '\'' || c == '"')
+    {
+      quote = c;
+      continue;
+    }
+    size_t start = i;
+    int fd = -1;
+    bool both = false;
+    if (isdigit(c) && (i == 0 || isspace(cmd_line[i - 1])))
+    {
+      size_t j = i;
+      while (isdigit(cmd_line[j]))
+        j++;
+      if (cmd_line[j] != '<' && cmd_line[j] != '>')
+      {
+        i = j - 1;
+        continue;
+      }
+      fd = atoi(cmd_line + i);
+      i = j;
+    }
+    else if (c == '&' && cmd_line[i + 1] == '>')
+    {
+      both = true;
+      i++;
+    }
+    if (cmd_line[i] != '<' && cmd_line[i] != '>')
+      continue;
+    Redirection redirection;
+    bool input = cmd_line[i] == '<';
+    redirection.fd = (fd != -1) ? fd : (input ? 0 : 1);
+    redirection.dup_fd = -1;
+    redirection.flags = input ? O_RDONLY : (O_WRONLY | O_CREAT | O_TRUNC);
+    i++;
+    if (!input && cmd_line[i] == '>')
+    {
+      redirection.flags = O_WRONLY | O_CREAT | O_APPEND;
+      i++;
+    }
+    if (!both && cmd_line[i] == '&' && isdigit(cmd_line[i + 1]))
+    {
+      // n>&m / n<&m
+      redirection.dup_fd = atoi(cmd_line + i + 1);
+      i++;
+      while (isdigit(cmd_line[i]))
+        i++;
     }
     else
     {
-      if (chdir(args[1]) != 0) {//fail: don't change directory
-        perror("smash error: chdir failed");
+      while (cmd_line[i] && isspace(cmd_line[i]))
+        i++;
+      size_t file_start = i;
+      // the target is one word, its quotes and backslashes taken off
+      char file_quote = 0;
+      while (cmd_line[i] && (file_quote || (!isspace(cmd_line[i]) && !strchr("<>|&;", cmd_line[i]))))
+      {
+        char f = cmd_line[i];
+        if (f == file_quote)
+          file_quote = 0;
+        else if (!file_quote && (f == '\'' || f == '"'))
+          file_quote = f;
+        else if (f == '\\' && file_quote != '\'' && cmd_line[i + 1] && (!file_quote || strchr("\"\\$`", cmd_line[i + 1])))
+          redirection.file += cmd_line[++i];
+        else
+          redirection.file += f;
+        i++;
       }
-      else{ //success - change dir
-        smash.SetPrev_Pwd(current_dir);
+      if (file_quote)
+      {
+        cerr << "smash error: syntax error: no matching `" << file_quote << "'" << endl;
+        return false;
+      }
+      if (i == file_start)
+      {
+        string token = cmd_line[i] ? string(1, cmd_line[i]) : "newline";
+        cerr << "smash error: syntax error near unexpected token `" << token << "'" << endl;
+        return false;
       }
     }
+    redirections.push_back(redirection);
+    if (both)
+    {
+      // &> file is > file 2>&1
+      redirections.push_back({2, 1, "", 0});
+    }
+    // cut it out with the blanks before it, so the line reads as if it was never there
+    while (start > 0 && isspace(cmd_line[start - 1]))
+      start--;
+    memmove(cmd_line + start, cmd_line + i, strlen(cmd_line + i) + 1);
+    i = start - 1;
   }
+  return true;
 }
 
-CatCommand::CatCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+bool RedirectionList::empty()
+{
+  return redirections.empty();
+}
 
-void CatCommand::execute()
+void RedirectionList::addDup(int fd, int dup_fd)
 {
-  // SmallShell &smash = SmallShell::getInstance();
-  char *args[20];
-  int num_args = _parseCommandLine(GetCmd_line(), args);
-  char buffer[20];
-  if (num_args == 1)
+  redirections.insert(redirections.begin(), {fd, dup_fd, "", 0});
+}
+
+// the redirections as posix_spawn file actions, run in the child in order
+void RedirectionList::addSpawnActions(posix_spawn_file_actions_t *actions)
+{
+  for (auto ir = redirections.begin(); ir != redirections.end(); ++ir)
   {
-    cout << "smash error: cat: not enough arguments" << endl;
+    if (ir->dup_fd != -1)
+      posix_spawn_file_actions_adddup2(actions, ir->dup_fd, ir->fd);
+    else
+      posix_spawn_file_actions_addopen(actions, ir->fd, ir->file.c_str(), ir->flags, 0666);
   }
-  for (int i = 1; i < num_args; i++)
+}
+
+// prints the error and stops at the first redirection that fails
+bool RedirectionList::apply()
+{
+  for (auto ir = redirections.begin(); ir != redirections.end(); ++ir)
   {
-    if ((strcmp(args[i], ">") == 0) || (strcmp(args[i], ">>") == 0) || (strcmp(args[i], "|") == 0) || (strcmp(args[i], "|&") == 0))
+    bool saved = false;
+    for (auto is = saved_fds.begin(); is != saved_fds.end(); ++is)
+      saved = saved || is->first == ir->fd;
+    if (!saved)
     {
-      break;
-    }
-    string file_name(args[i]);
-    int fd_cat = open((_trim(file_name)).c_str(), O_RDWR, 0666); //perror wrap
-    if (fd_cat == -1)
-    {
-      perror("smash error: open failed");
-      return;
+      int copy = fcntl(ir->fd, F_DUPFD_CLOEXEC, 10);
+      if (copy == -1 && errno != EBADF)
+      {
+        perror("smash error: dup failed");
+        return false;
+      }
+      saved_fds.push_back(make_pair(ir->fd, copy));
     }
-    int count = 20;
-    while (count == 20)
+    int new_fd = ir->dup_fd;
+    if (new_fd == -1)
     {
-      count = read(fd_cat, buffer, 20);
-      if (count == -1)
+      new_fd = open(ir->file.c_str(), ir->flags, 0666);
+      if (new_fd == -1)
       {
-        perror("smash error: read failed");
-        return;
+        perror("smash error: open failed");
+        return false;
       }
-      DO_SYS(write(1, buffer, count), "write");
     }
-    DO_SYS(close(fd_cat), "close");
+    if (new_fd != ir->fd && dup2(new_fd, ir->fd) == -1)
+    {
+      perror("smash error: dup2 failed");
+      if (ir->dup_fd == -1)
+        close(new_fd);
+      return false;
+    }
+    if (ir->dup_fd == -1 && new_fd != ir->fd)
+      close(new_fd);
   }
+  return true;
 }
 
-QuitCommand::QuitCommand(const char *cmd_line, shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
-
-void QuitCommand::execute()
+// for a child that shares the shell's memory until its exec: nothing is
+// saved or allocated, and a failure is left to the caller to report
+const char *RedirectionList::applyInChild() const
 {
-  SmallShell &smash = SmallShell::getInstance();
-  char *args[20];
-  int i = _parseCommandLine(GetCmd_line(), args);
-  if (i == 2 && strcmp(args[1], "kill") == 0)
+  for (auto ir = redirections.begin(); ir != redirections.end(); ++ir)
   {
-    jobs->killAllJobs();
+    int new_fd = ir->dup_fd;
+    if (new_fd == -1)
+    {
+      new_fd = open(ir->file.c_str(), ir->flags, 0666);
+      if (new_fd == -1)
+        return "smash error: open failed";
+    }
+    if (new_fd != ir->fd && dup2(new_fd, ir->fd) == -1)
+      return "smash error: dup2 failed";
+    if (ir->dup_fd == -1 && new_fd != ir->fd)
+      close(new_fd);
   }
-  else {
-    jobs->clearJobsList();
+  return NULL;
+}
+
+void RedirectionList::restore()
+{
+  for (auto ir = saved_fds.rbegin(); ir != saved_fds.rend(); ++ir)
+  {
+    if (ir->second == -1)
+    {
+      close(ir->first);
+      continue;
+    }
+    dup2(ir->second, ir->first);
+    close(ir->second);
   }
-  smash.SetRun(false);
-  // exit(0);
+  saved_fds.clear();
 }
 
-TimeoutCommand::TimeoutCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+/*----- OUTPUT BUFFER -----*/
 
-void TimeoutCommand::execute()
+OutputBuffer::OutputBuffer(int fd) : fd(fd), stream(NULL), previous(NULL)
 {
-  //add to times list + args[2] should be the external command
-  // SmallShell &smash = SmallShell::getInstance();
-  char *args[20];
-  _parseCommandLine(GetCmd_line(), args);
-  string cmd_line(GetCmd_line());
-  string args2(args[2]);
-  std::size_t pos = cmd_line.find(args2);
-  // clean cmd line so only command remains:
-  cmd_line = _trim(cmd_line.substr(pos));
-  char* cmd_line_c = (char*)(cmd_line.c_str());
-  _removeBackgroundSign(cmd_line_c);
-  char *bin_bash = strdup(const_cast<char *>("/bin/bash"));
-  char *c = strdup(const_cast<char *>("-c"));
-  char *exec_args[4] = {bin_bash, c, cmd_line_c, NULL};
-  DO_SYS(execvp(exec_args[0], exec_args), "execvp");
-  exit(0);
+  setp(buffer, buffer + OUTPUT_BUFFER_SIZE);
 }
 
-void TimeoutCommand::SetPid(pid_t new_pid)
+OutputBuffer::~OutputBuffer()
 {
-  pid = new_pid;
+  sync();
+  if (stream && stream->rdbuf() == this)
+    stream->rdbuf(previous);
 }
 
-pid_t TimeoutCommand::GetPid()
+void OutputBuffer::install(std::ostream &new_stream)
 {
-  return pid;
+  stream = &new_stream;
+  previous = new_stream.rdbuf(this);
 }
 
-/*----- FOREGROUND COMMANDS -----*/
-
-ForegroundCommand::ForegroundCommand(const char *cmd_line, shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
-
-void ForegroundCommand::execute()
+int OutputBuffer::overflow(int c)
 {
-  char *args[20];
-  int i = _parseCommandLine(GetCmd_line(), args);
-  // maximal job-id to
-  shared_ptr<JobsList::JobEntry> cur_job;
-  // bring max job to front
-  if (i == 1)
+  if (sync() == -1)
+    return traits_type::eof();
+  if (c != traits_type::eof())
   {
-    cur_job = jobs->getLastJob();
-    if (!cur_job)
-    {
-      std::cerr << "smash error: fg: jobs list is empty" << std::endl;
-      return;
-    }
-    
+    *pptr() = (char)c;
+    pbump(1);
   }
-  // bring forward specific job-id
-  else if (i == 2)
+  return traits_type::not_eof(c);
+}
+
+// writes out everything buffered. on failure (a reader that went away, a
+// full disk) the data is dropped so the next command starts clean.
+int OutputBuffer::sync()
+{
+  char *pos = pbase();
+  int res = 0;
+  while (pos < pptr())
   {
-    if (atoi(args[1]) == 0)
-    {
-      cerr << "smash error: fg: invalid arguments" << endl;
-      return;
-    }
-    else
+    ssize_t written = write(fd, pos, pptr() - pos);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1)
     {
-      cur_job = jobs->getJobById(atoi(args[1]));
-      if (!cur_job)
-      {
-        std::cerr << "smash error: fg: job-id " << args[1] << " does not exist" << std::endl;
-        return;
-      }
+      if (errno != EPIPE)
+        perror("smash error: write failed");
+      res = -1;
+      break;
     }
+    pos += written;
   }
-  else
-  {
-    std::cerr << "smash error: fg: invalid arguments" << std::endl;
-    return;
-  }
-  // remove from jobs list and execute
-  jobs->removeJobById(cur_job->GetJobID());
-  cout << cur_job->GetCommandLine() << " : " << cur_job->GetPid() << " " << endl;
-  SmallShell &smash = SmallShell::getInstance();
-  Command* cur_command = cur_job->GetCommand();
-  cur_command->SetForeground(true);
-  smash.SetCommand(cur_command);
-  if (cur_job->isStopped())
-  {
-    DO_SYS(kill(cur_job->GetPid(), SIGCONT), "kill");
-    cur_job->SetIsStopped(false);
+  setp(buffer, buffer + OUTPUT_BUFFER_SIZE);
+  return res;
+}
+
+// shell style exit code for a waitpid status
+int _exitStatus(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return 0;
+}
+
+bool _isBackgroundComamnd(const char *cmd_line)
+{
+  const string str(cmd_line);
+  size_t idx = str.find_last_not_of(WHITESPACE);
+  return idx != string::npos && str[idx] == '&';
+}
+
+// commands the shell launches as a child process of their own: externals and
+// the launch options around them (timeout, limit, pin, nice, sched, ionice)
+bool _spawnsChild(Command *cmd)
+{
+  if (typeid(*cmd) == typeid(ExternalCommand))
+    return true;
+  if (typeid(*cmd) == typeid(TimeoutCommand))
+    return ((TimeoutCommand *)cmd)->GetDurationMs() != -1;
+  if (typeid(*cmd) == typeid(LimitCommand))
+    return ((LimitCommand *)cmd)->hasCommand();
+  if (typeid(*cmd) == typeid(PinCommand))
+    return ((PinCommand *)cmd)->hasCommand();
+  if (typeid(*cmd) == typeid(PriorityCommand))
+    return ((PriorityCommand *)cmd)->hasCommand();
+  return false;
+}
+
+void _removeBackgroundSign(char *cmd_line)
+{
+  const string str(cmd_line);
+  // find last character other than spaces
+  size_t idx = str.find_last_not_of(WHITESPACE);
+  // if all characters are spaces then return
+  if (idx == string::npos)
+  {
+    return;
+  }
+  // if the command line does not end with & then return
+  if (cmd_line[idx] != '&')
+  {
+    return;
+  }
+  // replace the & (background sign) with space and then remove all tailing spaces.
+  cmd_line[idx] = ' ';
+  // truncate the command line string up to the last non-space character
+  cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+}
+
+// the command line from its word-th word on (0 is the first), without the
+// background sign: the command a launch option (limit, pin, nice...) runs
+string _cmdLineFromWord(const char *cmd_line, int word)
+{
+  string line(cmd_line);
+  size_t pos = 0;
+  for (int i = 0; i < word && pos != string::npos; i++)
+  {
+    pos = line.find_first_not_of(WHITESPACE, pos);
+    pos = line.find_first_of(WHITESPACE, pos);
+  }
+  line = (pos == string::npos) ? "" : _trim(line.substr(pos));
+  if (line.empty())
+    return line;
+  char *line_c = (char *)(line.c_str());
+  _removeBackgroundSign(line_c);
+  return string(line_c);
+}
+
+// characters that need bash to expand (quotes, globs, variables, subshells...)
+const std::string BASH_SPECIAL_CHARS = "*?[]{}~$`'\"\\()<>|&;!#=";
+
+// whether the command in words, from its first-th word on, needs bash
+bool _needsBash(CommandArgs &words, int first)
+{
+  if (words.size() <= first)
+    return true;
+  for (int i = first; i < words.size(); i++)
+  {
+    if (strpbrk(words[i], BASH_SPECIAL_CHARS.c_str()))
+      return true;
+  }
+  return false;
+}
+
+// writes value into one of a cgroup's interface files
+bool _writeCgroupFile(const string &cgroup, const char *file, const string &value, bool report = true)
+{
+  string path = cgroup + "/" + file;
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd == -1 || write(fd, value.c_str(), value.length()) == -1)
+  {
+    if (report)
+      perror(("smash error: limit: " + string(file)).c_str());
+    if (fd != -1)
+      close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// what a child is set up with before its exec, besides its fds
+struct LaunchSetup
+{
+  const char *cgroup; // cgroup directory to run in, NULL to stay in the shell's
+  const vector<int> *cpus; // cpus to run on, NULL for the shell's
+  LaunchPriority priority;
+  LaunchSetup() : cgroup(NULL), cpus(NULL) {}
+};
+
+// what a cloned child is launched with. it shares the shell's memory until
+// its exec, so the shell works everything out and the child only makes
+// system calls. it reports back through the same memory: the shell runs
+// again once the child has exec'd or exited
+struct LaunchChild
+{
+  const char *path;
+  char **argv;
+  pid_t pgid;
+  const RedirectionList *fds;
+  const char *cgroup_procs; // the cgroup's cgroup.procs, NULL to stay in the shell's
+  const cpu_set_t *cpus;    // NULL for the shell's
+  int policy;               // -1 to keep the shell's
+  bool has_nice;
+  int nice_value;           // the child's own, not an adjustment
+  int ioprio;               // -1 to keep the shell's
+  // filled in by the child: the error prefix and errno of the step that
+  // stopped it, and of the priorities it could not set
+  const char *failed;
+  int failed_errno;
+  const char *unset[3];
+  int unset_errno[3];
+  int unset_count;
+};
+
+void _launchChildUnset(LaunchChild *child, const char *prefix)
+{
+  child->unset[child->unset_count] = prefix;
+  child->unset_errno[child->unset_count++] = errno;
+}
+
+int _launchChild(void *arg)
+{
+  LaunchChild *child = (LaunchChild *)arg;
+  setpgid(0, child->pgid);
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+  child->failed = NULL;
+  if (child->cgroup_procs)
+  {
+    int fd = open(child->cgroup_procs, O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "0", 1) == -1)
+      child->failed = "smash error: limit: cgroup.procs";
+    if (fd != -1)
+      close(fd);
+  }
+  if (!child->failed && child->cpus && sched_setaffinity(0, sizeof(cpu_set_t), child->cpus) == -1)
+    child->failed = "smash error: sched_setaffinity failed";
+  if (child->failed)
+  {
+    child->failed_errno = errno;
+    _exit(127);
+  }
+  // like nice(1), a priority that cannot be set is reported and the
+  // command runs on
+  if (child->policy != -1)
+  {
+    struct sched_param param;
+    param.sched_priority = 0;
+    if (sched_setscheduler(0, child->policy, &param) == -1)
+      _launchChildUnset(child, "smash error: sched_setscheduler failed");
+  }
+  if (child->has_nice && setpriority(PRIO_PROCESS, 0, child->nice_value) == -1)
+    _launchChildUnset(child, "smash error: setpriority failed");
+  if (child->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, child->ioprio) == -1)
+    _launchChildUnset(child, "smash error: ioprio_set failed");
+  child->failed = child->fds->applyInChild();
+  if (!child->failed)
+  {
+    execv(child->path, child->argv);
+    child->failed = "smash error: execvp failed";
+  }
+  child->failed_errno = errno;
+  _exit(127);
+}
+
+// the cloned child's stack. launches never overlap: the shell waits in
+// clone until the child is done with it
+alignas(16) static char _launch_stack[64 * 1024];
+
+// for the setups posix_spawn cannot do before the exec: clone a child that
+// shares the shell's memory, as posix_spawn itself does, so the launch costs
+// the same however big the shell has grown. it sets itself up and execs
+pid_t _cloneCommandLine(const string &path, char **argv, RedirectionList &fds, pid_t pgid, const LaunchSetup &setup)
+{
+  LaunchChild child;
+  child.path = path.c_str();
+  child.argv = argv;
+  child.pgid = pgid;
+  child.fds = &fds;
+  string cgroup_procs;
+  child.cgroup_procs = NULL;
+  if (setup.cgroup)
+  {
+    cgroup_procs = string(setup.cgroup) + "/cgroup.procs";
+    child.cgroup_procs = cgroup_procs.c_str();
+  }
+  cpu_set_t cpus;
+  child.cpus = NULL;
+  if (setup.cpus)
+  {
+    CPU_ZERO(&cpus);
+    for (auto ir = setup.cpus->begin(); ir != setup.cpus->end(); ++ir)
+      CPU_SET(*ir, &cpus);
+    child.cpus = &cpus;
+  }
+  child.policy = setup.priority.policy;
+  child.has_nice = setup.priority.has_nice;
+  child.nice_value = 0;
+  if (child.has_nice)
+    child.nice_value = max(-20, min(19, getpriority(PRIO_PROCESS, 0) + setup.priority.nice));
+  child.ioprio = setup.priority.ioprio;
+  child.failed = NULL;
+  child.unset_count = 0;
+  PhaseTimer spawn_timer(ShellStats::PHASE_SPAWN, ShellStats::KIND_EXTERNAL);
+  pid_t pid = clone(_launchChild, _launch_stack + sizeof(_launch_stack), CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+  spawn_timer.stop();
+  if (pid == -1)
+  {
+    perror("smash error: clone failed");
+    return -1;
+  }
+  for (int i = 0; i < child.unset_count; i++)
+  {
+    errno = child.unset_errno[i];
+    perror(child.unset[i]);
+  }
+  if (child.failed)
+  {
+    errno = child.failed_errno;
+    perror(child.failed);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  return pid;
+}
+
+// some glibc builds take POSIX_SPAWN_SETSCHEDULER and do nothing with it.
+// where it does nothing, or that cannot be told, the policy is set by the
+// cloned child instead
+bool _spawn_sets_policy = false;
+
+// run once at startup: a cat with another policy than the shell's, blocked
+// on an empty pipe until its policy has been looked at
+bool _probeSpawnSetsPolicy()
+{
+  int fd[2];
+  if (pipe2(fd, O_CLOEXEC) == -1)
+    return false;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fd[0], 0);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  int policy = sched_getscheduler(0) == SCHED_BATCH ? SCHED_IDLE : SCHED_BATCH;
+  struct sched_param param;
+  param.sched_priority = 0;
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSCHEDULER);
+  posix_spawnattr_setschedpolicy(&attr, policy);
+  posix_spawnattr_setschedparam(&attr, &param);
+  char *argv[] = {(char *)"cat", NULL};
+  pid_t pid;
+  int err = posix_spawn(&pid, "/bin/cat", &actions, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fd[0]);
+  bool sets_policy = err == 0 && sched_getscheduler(pid) == policy;
+  close(fd[1]);
+  if (err == 0)
+    waitpid(pid, NULL, 0);
+  return sets_policy;
+}
+
+// posix_spawn with the setup it can do itself
+pid_t _posixSpawnCommandLine(const string &path, char **argv, RedirectionList &fds, pid_t pgid, const LaunchSetup &setup)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (!fds.empty())
+  {
+    PhaseTimer redirect_timer(ShellStats::PHASE_REDIRECT, ShellStats::KIND_EXTERNAL);
+    fds.addSpawnActions(&actions);
+  }
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  // the shell keeps its signals blocked for the signalfd, the child must not
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_SETCGROUP
+  // newer glibc clones the child straight into the cgroup
+  int cgroup_fd = -1;
+  if (setup.cgroup)
+  {
+    cgroup_fd = open(setup.cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup_fd == -1)
+    {
+      perror("smash error: open failed");
+      posix_spawnattr_destroy(&attr);
+      posix_spawn_file_actions_destroy(&actions);
+      return -1;
+    }
+    flags |= POSIX_SPAWN_SETCGROUP;
+    posix_spawnattr_setcgroup_np(&attr, cgroup_fd);
+  }
+#endif
+  if (setup.priority.policy != -1)
+  {
+    struct sched_param param;
+    param.sched_priority = 0;
+    flags |= POSIX_SPAWN_SETSCHEDULER;
+    posix_spawnattr_setschedpolicy(&attr, setup.priority.policy);
+    posix_spawnattr_setschedparam(&attr, &param);
+  }
+  posix_spawnattr_setflags(&attr, flags);
+  posix_spawnattr_setpgroup(&attr, pgid);
+  posix_spawnattr_setsigmask(&attr, &empty_mask);
+  pid_t pid;
+  PhaseTimer spawn_timer(ShellStats::PHASE_SPAWN, ShellStats::KIND_EXTERNAL);
+  int err = posix_spawn(&pid, path.c_str(), &actions, &attr, argv, environ);
+  spawn_timer.stop();
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+#ifdef POSIX_SPAWN_SETCGROUP
+  if (cgroup_fd != -1)
+    close(cgroup_fd);
+#endif
+  if (err != 0)
+  {
+    errno = err;
+    perror("smash error: execvp failed");
+    return -1;
+  }
+  return pid;
+}
+
+// launches cmd's command, from the word-th word of its line on (0 for an
+// external, past the options for timeout, limit...), into process group
+// pgid (0 for a new group), with fds redirected in the child before exec.
+// posix_spawn does it unless the setup needs the child's own code to run
+// before the exec, then it is a clone sharing the shell's memory. a background command also
+// gets its cpus from the affinity policy, and the background priorities it
+// does not set itself.
+// a simple command execs the words cmd was split into when it was created,
+// so nothing is parsed or allocated again here; the rest goes through
+// /bin/bash -c. returns the child pid, or -1 on failure.
+pid_t _spawnCommandLine(Command *cmd, int word, RedirectionList &fds, pid_t pgid, const LaunchSetup &setup = LaunchSetup())
+{
+  CommandArgs &words = cmd->GetArgs();
+  char **argv = words.data() + word;
+  string line;
+  char *bash_argv[] = {(char *)"/bin/bash", (char *)"-c", NULL, NULL};
+  if (_needsBash(words, word))
+  {
+    line = _cmdLineFromWord(cmd->GetCmd_line(), word);
+    bash_argv[2] = (char *)line.c_str();
+    argv = bash_argv;
+  }
+  // PATH is searched through the shell's cache instead of by posix_spawnp
+  SmallShell &smash = SmallShell::getInstance();
+  PhaseTimer lookup_timer(ShellStats::PHASE_LOOKUP, ShellStats::KIND_EXTERNAL);
+  const string &path = smash.GetPathCacheReference().lookup(argv[0]);
+  lookup_timer.stop();
+  if (path.empty())
+  {
+    errno = ENOENT;
+    perror("smash error: execvp failed");
+    return -1;
+  }
+  LaunchSetup child_setup = setup;
+  AffinityList &affinity = smash.GetAffinityReference();
+  AffinityList::Assignment assignment;
+  bool assigned = !cmd->isForeground() && !setup.cpus && affinity.pick(assignment);
+  if (assigned)
+    child_setup.cpus = &assignment.cpus;
+  if (!cmd->isForeground())
+    child_setup.priority = setup.priority.withDefaults(smash.GetBackgroundPriorityReference());
+  // posix_spawn cannot set the cpus, nice or io priority, nor the cgroup
+  // without SETCGROUP
+  bool needs_clone = child_setup.cpus != NULL || child_setup.priority.needsChild();
+  needs_clone = needs_clone || (child_setup.priority.policy != -1 && !_spawn_sets_policy);
+#ifndef POSIX_SPAWN_SETCGROUP
+  needs_clone = needs_clone || child_setup.cgroup != NULL;
+#endif
+  pid_t pid;
+  if (needs_clone)
+    pid = _cloneCommandLine(path, argv, fds, pgid, child_setup);
+  else
+    pid = _posixSpawnCommandLine(path, argv, fds, pgid, child_setup);
+  if (pid != -1 && assigned)
+    affinity.add(pid, assignment);
+  return pid;
+}
+
+Command::Command(const char *cmd_line) :
+  arena(SmallShell::getInstance().GetCommandArena().owns(this) ? &SmallShell::getInstance().GetCommandArena() : NULL),
+  cmd_line(arena ? arena->copyString(cmd_line) : strdup(cmd_line)), args(cmd_line, arena), foreground(true) {}
+
+Command::~Command()
+{
+  if (!arena)
+    free((char *)cmd_line);
+}
+
+const char *Command::GetCmd_line()
+{
+  return cmd_line;
+}
+
+CommandArgs &Command::GetArgs()
+{
+  return args;
+}
+
+bool Command::isForeground(){
+  return foreground;
+}
+
+void Command::SetForeground(bool fg){
+  foreground = fg;
+}
+
+/*----- BUILT IN COMMANDS -----*/
+
+BuiltInCommand::BuiltInCommand(const char *cmd_line) : Command(cmd_line) {}
+
+ChPromptCommand::ChPromptCommand(const char *cmd_line, std::string &prompt) : BuiltInCommand(cmd_line)
+{
+  CommandArgs &args = GetArgs();
+  if (!args[1])
+    prompt = "smash> ";
+  else
+    prompt = string(args[1]) + "> ";
+}
+
+Command *_createChPromptCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  return smash.GetCommandArena().create<ChPromptCommand>(cmd_line, smash.GetPrompt());
+}
+REGISTER_BUILTIN_FACTORY("chprompt", _createChPromptCommand);
+
+void ChPromptCommand::execute() {}
+
+ShowPidCommand::ShowPidCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("showpid", ShowPidCommand);
+
+void ShowPidCommand::execute()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  std::cout << "smash pid is " << smash.GetShellPid() << std::endl;
+}
+
+PwdCommand::PwdCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("pwd", PwdCommand);
+
+void PwdCommand::execute()
+{
+  char *buffer = NULL;
+  string res(getcwd(buffer, 0));
+  if (res == "")
+  {
+    perror("smash error: getcwd failed");
+    SmallShell::getInstance().SetLastStatus(1);
+  }
+  std::cout << res << std::endl;
+}
+
+JobsCommand::JobsCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("jobs", JobsCommand);
+
+void JobsCommand::execute()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  smash.RemoveFinishedJobs();
+  CommandArgs &args = GetArgs();
+  if (args[1] && strcmp(args[1], "-l") == 0)
+  {
+    smash.GetJobsListReference().printJobsDetails();
+    return;
+  }
+  smash.printJobsList();
+}
+
+KillCommand::KillCommand(const char *cmd_line, JobsList &jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+
+Command *_createKillCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  return smash.GetCommandArena().create<KillCommand>(cmd_line, smash.GetJobsListReference());
+}
+REGISTER_BUILTIN_FACTORY("kill", _createKillCommand);
+
+void KillCommand::execute()
+{
+  CommandArgs &args = GetArgs();
+  int i = args.size();
+  if (i != 3)
+  {
+    cerr << "smash error: kill: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  string signal(args[1]);
+  string signal_num;
+  if (signal.find("-")== 0) {
+    signal_num = signal.substr(1);
+  }
+  else{
+    cerr << "smash error: kill: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  if (atoi(signal_num.c_str()) == 0 || atoi(args[2]) == 0) {
+    cerr << "smash error: kill: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  shared_ptr<JobsList::JobEntry> curr_job = jobs.getJobById(atoi(args[2]));
+  if (!curr_job)
+  {
+    std::cerr << "smash error: kill: job-id " << args[2] << " does not exist" << std::endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  int signum = atoi(signal_num.c_str());
+  // a limited job goes down together with everything it started
+  if (signum == SIGKILL)
+  {
+    SmallShell::getInstance().GetCgroupListReference().killAll(curr_job->GetPid());
+  }
+  DO_SYS(curr_job->sendSignal(signum), "kill");
+  std::cout << "signal number " << signum << " was sent to pid " << curr_job->GetPid() << endl;
+  // a bg or fg right after must already see the job stopped or running.
+  // other signals (SIGTSTP...) may be caught, their changes come with the sweep
+  if ((signum == SIGSTOP && !curr_job->isStopped()) || (signum == SIGCONT && curr_job->isStopped()))
+  {
+    jobs.waitForState(curr_job, signum == SIGSTOP);
+  }
+}
+
+CdCommand::CdCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("cd", CdCommand);
+
+void CdCommand::execute()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  CommandArgs &args = GetArgs();
+  int i = args.size();
+  if (i == 1)
+    return;
+  if (smash.GetPrev_pwd() == "" && string(args[1]) == "-")
+  {
+    std::cerr << "smash error: cd: OLDPWD not set" << std::endl;
+    smash.SetLastStatus(1);
+    return;
+  }
+  if (i > 2)
+  {
+    std::cerr << "smash error: cd: too many arguments" << std::endl;
+    smash.SetLastStatus(1);
+  }
+  if (i == 2)
+  {
+    char *buffer = NULL;
+    std::string temp_prev = smash.GetPrev_pwd();
+    string current_dir = getcwd(buffer, 0);
+    if (current_dir == "")
+    {
+      perror("smash error: getcwd failed");
+      smash.SetLastStatus(1);
+    }
+    _removeBackgroundSign(args[1]);
+    // change to previous directory
+    if (string(args[1]) == "-") 
+    {
+      smash.SetPrev_Pwd(current_dir);
+      DO_SYS(chdir(temp_prev.c_str()), "chdir");
+    }
+    else
+    {
+      if (chdir(args[1]) != 0) {//fail: don't change directory
+        perror("smash error: chdir failed");
+        smash.SetLastStatus(1);
+      }
+      else{ //success - change dir
+        smash.SetPrev_Pwd(current_dir);
+      }
+    }
+  }
+}
+
+CatCommand::CatCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("cat", CatCommand);
+
+#define CAT_CHUNK_SIZE (1 << 16)
+
+// copies in_fd to out_fd until EOF without going through user space when the
+// kernel allows it: copy_file_range into regular files, splice into pipes,
+// sendfile otherwise, and a plain read/write loop as the last resort.
+// prints the error and returns -1 on failure.
+int _copyFileContents(int in_fd, int out_fd)
+{
+  struct stat out_stat;
+  if (fstat(out_fd, &out_stat) == -1)
+  {
+    perror("smash error: fstat failed");
+    return -1;
+  }
+  int out_flags = fcntl(out_fd, F_GETFL);
+  ssize_t count;
+  // copy_file_range refuses O_APPEND outputs (>> redirection)
+  if (S_ISREG(out_stat.st_mode) && out_flags != -1 && !(out_flags & O_APPEND))
+  {
+    while ((count = copy_file_range(in_fd, NULL, out_fd, NULL, CAT_CHUNK_SIZE, 0)) > 0);
+    if (count == 0)
+      return 0;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+    {
+      perror("smash error: copy_file_range failed");
+      return -1;
+    }
+  }
+  else if (S_ISFIFO(out_stat.st_mode))
+  {
+    while ((count = splice(in_fd, NULL, out_fd, NULL, CAT_CHUNK_SIZE, SPLICE_F_MORE)) > 0);
+    if (count == 0)
+      return 0;
+    // the reader went away: stop quietly, like cat killed by SIGPIPE
+    if (errno == EPIPE)
+      return -1;
+    if (errno != EINVAL)
+    {
+      perror("smash error: splice failed");
+      return -1;
+    }
+  }
+  // the fallbacks continue from wherever the previous attempt stopped
+  while ((count = sendfile(out_fd, in_fd, NULL, CAT_CHUNK_SIZE)) > 0);
+  if (count == 0)
+    return 0;
+  if (errno == EPIPE)
+    return -1;
+  if (errno != EINVAL && errno != ENOSYS)
+  {
+    perror("smash error: sendfile failed");
+    return -1;
+  }
+  static char buffer[CAT_CHUNK_SIZE];
+  while ((count = read(in_fd, buffer, CAT_CHUNK_SIZE)) > 0)
+  {
+    for (ssize_t written = 0; written < count;)
+    {
+      ssize_t res = write(out_fd, buffer + written, count - written);
+      if (res == -1 && errno == EPIPE)
+        return -1;
+      if (res == -1)
+      {
+        perror("smash error: write failed");
+        return -1;
+      }
+      written += res;
+    }
+  }
+  if (count == -1)
+  {
+    perror("smash error: read failed");
+    return -1;
+  }
+  return 0;
+}
+
+void CatCommand::execute()
+{
+  // SmallShell &smash = SmallShell::getInstance();
+  CommandArgs &args = GetArgs();
+  int num_args = args.size();
+  if (num_args == 1)
+  {
+    cout << "smash error: cat: not enough arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+  }
+  // anything already printed through cout has to land before the file data
+  cout.flush();
+  for (int i = 1; i < num_args; i++)
+  {
+    string file_name(args[i]);
+    int fd_cat = open((_trim(file_name)).c_str(), O_RDONLY); //perror wrap
+    if (fd_cat == -1)
+    {
+      perror("smash error: open failed");
+      SmallShell::getInstance().SetLastStatus(1);
+      return;
+    }
+    if (_copyFileContents(fd_cat, 1) == -1)
+    {
+      close(fd_cat);
+      return;
+    }
+    DO_SYS(close(fd_cat), "close");
+  }
+}
+
+QuitCommand::QuitCommand(const char *cmd_line, JobsList &jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+
+Command *_createQuitCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  return smash.GetCommandArena().create<QuitCommand>(cmd_line, smash.GetJobsListReference());
+}
+REGISTER_BUILTIN_FACTORY("quit", _createQuitCommand);
+
+void QuitCommand::execute()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  CommandArgs &args = GetArgs();
+  int i = args.size();
+  if (i == 2 && strcmp(args[1], "kill") == 0)
+  {
+    jobs.killAllJobs();
+  }
+  else {
+    jobs.clearJobsList();
+  }
+  smash.SetRun(false);
+  // exit(0);
+}
+
+TimeoutCommand::TimeoutCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("timeout", TimeoutCommand);
+
+// timeout duration in milliseconds (fractions of a second are allowed),
+// or -1 if the arguments are invalid
+long long TimeoutCommand::GetDurationMs()
+{
+  CommandArgs &args = GetArgs();
+  int num_args = args.size();
+  if (num_args < 3)
+  {
+    return -1;
+  }
+  char *end;
+  double secs = strtod(args[1], &end);
+  if (*end != '\0' || !(secs > 0))
+  {
+    return -1;
+  }
+  return (long long)(secs * 1000 + 0.5);
+}
+
+// valid ones are started through spawn
+void TimeoutCommand::execute()
+{
+  cerr << "smash error: timeout: invalid arguments" << endl;
+  SmallShell::getInstance().SetLastStatus(1);
+}
+
+pid_t TimeoutCommand::spawn(RedirectionList &fds, pid_t pgid)
+{
+  return _spawnCommandLine(this, 2, fds, pgid);
+}
+
+void TimeoutCommand::SetPid(pid_t new_pid)
+{
+  pid = new_pid;
+}
+
+pid_t TimeoutCommand::GetPid()
+{
+  return pid;
+}
+
+/*----- FOREGROUND COMMANDS -----*/
+
+ForegroundCommand::ForegroundCommand(const char *cmd_line, JobsList &jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+
+Command *_createForegroundCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  return smash.GetCommandArena().create<ForegroundCommand>(cmd_line, smash.GetJobsListReference());
+}
+REGISTER_BUILTIN_FACTORY("fg", _createForegroundCommand);
+
+void ForegroundCommand::execute()
+{
+  CommandArgs &args = GetArgs();
+  int i = args.size();
+  // maximal job-id to
+  shared_ptr<JobsList::JobEntry> cur_job;
+  // bring max job to front
+  if (i == 1)
+  {
+    cur_job = jobs.getLastJob();
+    if (!cur_job)
+    {
+      std::cerr << "smash error: fg: jobs list is empty" << std::endl;
+      SmallShell::getInstance().SetLastStatus(1);
+      return;
+    }
+    
+  }
+  // bring forward specific job-id
+  else if (i == 2)
+  {
+    if (atoi(args[1]) == 0)
+    {
+      cerr << "smash error: fg: invalid arguments" << endl;
+      SmallShell::getInstance().SetLastStatus(1);
+      return;
+    }
+    else
+    {
+      cur_job = jobs.getJobById(atoi(args[1]));
+      if (!cur_job)
+      {
+        std::cerr << "smash error: fg: job-id " << args[1] << " does not exist" << std::endl;
+        SmallShell::getInstance().SetLastStatus(1);
+        return;
+      }
+    }
+  }
+  else
+  {
+    std::cerr << "smash error: fg: invalid arguments" << std::endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  // remove from jobs list and execute
+  jobs.removeJobById(cur_job->GetJobID());
+  cout << cur_job->GetCommandLine() << " : " << cur_job->GetPid() << " " << endl;
+  SmallShell &smash = SmallShell::getInstance();
+  Command* cur_command = cur_job->GetCommand();
+  cur_command->SetForeground(true);
+  smash.SetCommand(cur_command);
+  if (cur_job->isStopped())
+  {
+    DO_SYS(cur_job->sendSignal(SIGCONT), "kill");
+    cur_job->SetIsStopped(false);
+    smash.GetTraceLogReference().instant("continue (fg)", "job", cur_job->GetPid(), cur_job->GetCommandLine());
+  }
+  int status;
+  struct rusage usage;
+  DO_SYS(smash.waitForChild(cur_job->GetPid(), &status, WUNTRACED, &usage), "wait4");
+  smash.SetLastStatus(_exitStatus(status));
+  if (WIFSTOPPED(status))
+  {
+    smash.RemoveFinishedJobs();
+    jobs.addJobWithId(cur_job->GetCommandPtr(), cur_job->GetPid(), cur_job->GetJobID(), true);
+    return;
+  }
+  jobs.addFinishedJob(cur_job, status, usage);
+  smash.GetTimesListReference().cancelTimeout(cur_job->GetPid());
+  smash.GetCgroupListReference().release(cur_job->GetPid());
+  smash.GetAffinityReference().release(cur_job->GetPid());
+}
+/*----- BACKGROUND COMMANDS -----*/
+
+BackgroundCommand::BackgroundCommand(const char *cmd_line, JobsList &jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+
+Command *_createBackgroundCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  return smash.GetCommandArena().create<BackgroundCommand>(cmd_line, smash.GetJobsListReference());
+}
+REGISTER_BUILTIN_FACTORY("bg", _createBackgroundCommand);
+
+void BackgroundCommand::execute()
+{
+  CommandArgs &args = GetArgs();
+  int i = args.size();
+  shared_ptr<JobsList::JobEntry> cur_job;
+  // bring max job && stopped to front
+  if (i == 1)
+  {
+    cur_job = jobs.getLastStoppedJob();
+    if (!cur_job)
+    {
+      std::cerr << "smash error: bg: there is no stopped jobs to resume" << std::endl;
+      SmallShell::getInstance().SetLastStatus(1);
+      return;
+    }
+  }
+  // bring forward specific job-id
+  else if (i == 2)
+  {
+    if (atoi(args[1]) == 0)
+    {
+      cerr << "smash error: bg: invalid arguments" << endl;
+      SmallShell::getInstance().SetLastStatus(1);
+      return;
+    }
+    else
+    {
+      cur_job = jobs.getJobById(atoi(args[1]));
+      if (!cur_job)
+      {
+        std::cerr << "smash error: bg: job-id " << args[1] << " does not exist" << std::endl;
+        SmallShell::getInstance().SetLastStatus(1);
+        return;
+      }
+      if (cur_job->isStopped() == false)
+      {
+        std::cerr << "smash error: bg: job-id " << args[1] << " is already running in the background" << std::endl;
+        SmallShell::getInstance().SetLastStatus(1);
+        return;
+      }
+    }
+  }
+  else
+  {
+    std::cerr << "smash error: bg: invalid arguments" << std::endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  // set stopped and execute in background
+  cout << cur_job->GetCommandLine() << " : " << cur_job->GetPid() << " " << endl;
+  DO_SYS(cur_job->sendSignal(SIGCONT), "kill");
+  cur_job->SetIsStopped(false);
+  SmallShell::getInstance().GetTraceLogReference().instant("continue (bg)", "job", cur_job->GetPid(), cur_job->GetCommandLine());
+}
+
+/*----- EXTERNAL COMMANDS -----*/
+
+ExternalCommand::ExternalCommand(const char *cmd_line) : Command(cmd_line), pid(-1) {}
+
+// externals only ever run through spawn
+void ExternalCommand::execute() {}
+
+pid_t ExternalCommand::spawn(RedirectionList &fds, pid_t pgid)
+{
+  return _spawnCommandLine(this, 0, fds, pgid);
+}
+
+void ExternalCommand::SetPid(pid_t new_pid)
+{
+  pid = new_pid;
+}
+
+pid_t ExternalCommand::GetPid()
+{
+  return pid;
+}
+
+/*----- PIPELINES -----*/
+
+PipeCommand::PipeCommand(const char *cmd_line) : Command(cmd_line) {}
+
+// pipelines only ever run through SmallShell::executePipeCommand
+void PipeCommand::execute() {}
+
+void PipeCommand::addStage(pid_t pid)
+{
+  stage_pids.push_back(pid);
+}
+
+vector<pid_t> &PipeCommand::GetStagePids()
+{
+  return stage_pids;
+}
+
+pid_t PipeCommand::GetPid()
+{
+  return stage_pids.empty() ? -1 : stage_pids.back();
+}
+
+// a reaped stage's pid may belong to someone else by now, so only the
+// processes still in the pipeline's group
+vector<pid_t> PipeCommand::GetForegroundPids()
+{
+  vector<pid_t> pids;
+  for (auto ir = stage_pids.begin(); ir != stage_pids.end(); ++ir)
+  {
+    if (getpgid(*ir) == stage_pids.front())
+      pids.push_back(*ir);
+  }
+  return pids;
+}
+
+/*----- JOBS LIST -----*/
+
+JobsList::JobEntry::JobEntry() : job_id(-1), pid(-1), cmd(NULL), is_stopped(false), time(0), group_id(0){};
+
+JobsList::JobEntry::JobEntry(int job_id, pid_t pid, shared_ptr<Command> cmd, bool is_stopped, time_t time) : job_id(job_id), pid(pid), cmd(cmd), is_stopped(is_stopped), time(time), group_id(0){};
+
+int JobsList::JobEntry::GetGroupId()
+{
+  return group_id;
+}
+
+void JobsList::JobEntry::SetGroupId(int new_group_id)
+{
+  group_id = new_group_id;
+}
+
+int JobsList::JobEntry::sendSignal(int signum)
+{
+  vector<pid_t> pids = cmd->GetForegroundPids();
+  for (auto ir = pids.begin(); ir != pids.end(); ++ir)
+  {
+    if (*ir > 0 && kill(*ir, signum) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+bool JobsList::JobEntry::isStopped()
+{
+  return is_stopped;
+}
+
+void JobsList::JobEntry::SetIsStopped(bool isStopped)
+{
+  is_stopped = isStopped;
+}
+
+const int &JobsList::JobEntry::GetJobID()
+{
+  return job_id;
+}
+
+pid_t JobsList::JobEntry::GetPid()
+{
+  return pid;
+}
+
+const char *JobsList::JobEntry::GetCommandLine()
+{
+  return cmd->GetCmd_line();
+}
+
+time_t JobsList::JobEntry::GetTime()
+{
+  return time;
+}
+
+Command *JobsList::JobEntry::GetCommand()
+{
+  return cmd.get();
+}
+
+shared_ptr<Command> JobsList::JobEntry::GetCommandPtr()
+{
+  return cmd;
+}
+
+JobsList::JobUsage::JobUsage() : user_secs(0), sys_secs(0), max_rss_kb(0), vol_ctxsw(0), invol_ctxsw(0) {}
+
+JobsList::JobUsage::JobUsage(const struct rusage &usage) :
+  user_secs(usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6),
+  sys_secs(usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6),
+  max_rss_kb(usage.ru_maxrss), vol_ctxsw(usage.ru_nvcsw), invol_ctxsw(usage.ru_nivcsw) {}
+
+// live numbers of a process that has not been reaped yet, from /proc
+bool JobsList::JobUsage::readProc(pid_t pid)
+{
+  std::ifstream stat_file("/proc/" + to_string(pid) + "/stat");
+  string stat_line;
+  if (!std::getline(stat_file, stat_line))
+  {
+    return false;
+  }
+  // the command name may contain spaces, fields are counted after its ')'
+  std::istringstream fields(stat_line.substr(stat_line.rfind(')') + 2));
+  string field;
+  unsigned long utime = 0, stime = 0;
+  for (int i = 3; fields >> field && i <= 15; i++)
+  {
+    if (i == 14)
+      utime = stoul(field);
+    if (i == 15)
+      stime = stoul(field);
+  }
+  long ticks = sysconf(_SC_CLK_TCK);
+  user_secs = (double)utime / ticks;
+  sys_secs = (double)stime / ticks;
+  std::ifstream status_file("/proc/" + to_string(pid) + "/status");
+  for (string line; std::getline(status_file, line);)
+  {
+    std::istringstream words(line);
+    string key;
+    long value;
+    if (!(words >> key >> value))
+      continue;
+    if (key == "VmHWM:")
+      max_rss_kb = value;
+    else if (key == "voluntary_ctxt_switches:")
+      vol_ctxsw = value;
+    else if (key == "nonvoluntary_ctxt_switches:")
+      invol_ctxsw = value;
+  }
+  return true;
+}
+
+void JobsList::JobUsage::print()
+{
+  cout << fixed << setprecision(2) << "user " << user_secs << "s sys " << sys_secs << "s" << defaultfloat;
+  cout << " maxrss " << max_rss_kb << "kB ctxsw " << vol_ctxsw << "/" << invol_ctxsw;
+}
+
+JobsList::JobsList() : jobs_list(1), max_job_id(0), num_jobs(0), max_group_id(0) {}
+
+int JobsList::newGroupId()
+{
+  return ++max_group_id;
+}
+
+void JobsList::addJob(shared_ptr<Command> cmd, pid_t pid, bool isStopped)
+{
+  addJobWithId(cmd, pid, max_job_id + 1, isStopped);
+}
+
+void JobsList::addJobWithId(shared_ptr<Command> cmd, pid_t pid, int job_id, bool isStopped)
+{
+  shared_ptr<JobEntry> new_job(new JobEntry(job_id, pid, cmd, isStopped, time(NULL)));
+  if ((int)jobs_list.size() <= job_id)
+  {
+    jobs_list.resize(job_id + 1);
+  }
+  if (!jobs_list[job_id])
+  {
+    num_jobs++;
+  }
+  jobs_list[job_id] = new_job;
+  jobs_by_pid[pid] = new_job;
+  if (max_job_id < job_id)
+  {
+    max_job_id = job_id;
+  }
+  // printJobsList();
+}
+
+void JobsList::printJobsList()
+{
+  for (int id = 1; id <= max_job_id; id++)
+  {
+    shared_ptr<JobEntry> job = jobs_list[id];
+    if (!job)
+      continue;
+    cout << "[" << job->GetJobID() << "] " << job->GetCommandLine() << " : " << job->GetPid() << " " << difftime(time(NULL), job->GetTime()) << " secs";
+    if (job->isStopped())
+    {
+      cout << " (stopped)";
+    }
+    cout << '\n';
+  }
+}
+
+// jobs -l: resource usage of the running jobs, then the recently finished ones
+void JobsList::printJobsDetails()
+{
+  for (int id = 1; id <= max_job_id; id++)
+  {
+    shared_ptr<JobEntry> job = jobs_list[id];
+    if (!job)
+      continue;
+    cout << "[" << job->GetJobID() << "] " << job->GetCommandLine() << " : " << job->GetPid() << " " << difftime(time(NULL), job->GetTime()) << " secs";
+    cout << (job->isStopped() ? " (stopped) " : " (running) ");
+    if (job->GetGroupId())
+    {
+      cout << "group " << job->GetGroupId() << " ";
+    }
+    JobUsage usage;
+    if (usage.readProc(job->GetPid()))
+    {
+      usage.print();
+    }
+    SmallShell::getInstance().GetCgroupListReference().printUsage(job->GetPid());
+    string cpus = SmallShell::getInstance().GetAffinityReference().describe(job->GetPid());
+    if (!cpus.empty())
+    {
+      cout << " " << cpus;
+    }
+    cout << '\n';
+  }
+  if (finished_jobs.empty())
+  {
+    return;
+  }
+  cout << "recently finished:\n";
+  for (auto ir = finished_jobs.begin(); ir != finished_jobs.end(); ++ir)
+  {
+    cout << "[" << ir->job_id << "] " << ir->cmd_line << " : " << ir->pid << " " << ir->run_secs << " secs (exit " << ir->exit_status << ") ";
+    ir->usage.print();
+    cout << '\n';
+  }
+}
+
+void JobsList::clearJobsList(){
+  jobs_list.assign(1, nullptr);
+  jobs_by_pid.clear();
+  max_job_id = 0;
+  num_jobs = 0;
+}
+
+void JobsList::killAllJobs()
+{
+  cout << "smash: sending SIGKILL signal to " << num_jobs << " jobs:\n";
+  for (int id = 1; id <= max_job_id; id++)
+  {
+    shared_ptr<JobEntry> job = jobs_list[id];
+    if (!job)
+      continue;
+    // a limited job goes down together with everything it started
+    SmallShell::getInstance().GetCgroupListReference().killAll(job->GetPid());
+    DO_SYS(job->sendSignal(SIGKILL), "kill");
+    cout << job->GetPid() << ": " << job->GetCommandLine() << '\n';
+  }
+  jobs_list.assign(1, nullptr);
+  jobs_by_pid.clear();
+  max_job_id = 0;
+  num_jobs = 0;
+}
+
+// keeps what is left of a reaped job for jobs -l
+void JobsList::addFinishedJob(shared_ptr<JobEntry> job, int status, const struct rusage &usage)
+{
+  FinishedJob finished = {job->GetJobID(), job->GetPid(), job->GetCommandLine(), _exitStatus(status), (time_t)difftime(time(NULL), job->GetTime()), JobUsage(usage)};
+  finished_jobs.push_back(finished);
+  if (finished_jobs.size() > FINISHED_JOBS_MAX)
+  {
+    finished_jobs.pop_front();
+  }
+}
+
+// takes the job's state change, if it has one. a job that is gone goes to
+// the finished ones and out of the list. false if nothing changed.
+bool JobsList::collectJob(shared_ptr<JobEntry> job)
+{
+  int status;
+  struct rusage usage;
+  if (wait4(job->GetPid(), &status, WNOHANG | WUNTRACED | WCONTINUED, &usage) <= 0)
+    return false;
+  if (WIFSTOPPED(status))
+  {
+    job->SetIsStopped(true);
+    return true;
+  }
+  if (WIFCONTINUED(status))
+  {
+    job->SetIsStopped(false);
+    return true;
+  }
+  // exited or killed
+  addFinishedJob(job, status, usage);
+  SmallShell::getInstance().GetTimesListReference().cancelTimeout(job->GetPid());
+  SmallShell::getInstance().GetCgroupListReference().release(job->GetPid());
+  SmallShell::getInstance().GetAffinityReference().release(job->GetPid());
+  removeJobById(job->GetJobID());
+  return true;
+}
+
+void JobsList::removeFinishedJobs()
+{
+  // nothing to collect unless SIGCHLD arrived since the last sweep
+  if (!child_status_changed)
+  {
+    return;
+  }
+  // clear before sweeping so a child changing state mid-sweep is not missed
+  child_status_changed = 0;
+  PhaseTimer sweep_timer(ShellStats::PHASE_SWEEP, ShellStats::KIND_SHELL);
+  // only the children that changed: waitid peeks at the next one without
+  // taking its state, wait4 then takes it for its job. a child that is not a
+  // job (a pipeline stage still being waited for) would come back every
+  // time, so then every job is asked instead
+  while (true)
+  {
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0)
+      return;
+    shared_ptr<JobEntry> job = getJobByPid(info.si_pid);
+    if (job ? !collectJob(job) : !collectStray(info.si_pid))
+      break;
+  }
+  for (int id = 1; id <= max_job_id; id++)
+  {
+    if (jobs_list[id])
+      collectJob(jobs_list[id]);
+  }
+  vector<pid_t> strays = stray_pids;
+  for (auto ir = strays.begin(); ir != strays.end(); ++ir)
+    collectStray(*ir);
+}
+
+void JobsList::addStray(pid_t pid)
+{
+  stray_pids.push_back(pid);
+}
+
+// a stray's stops and continues are its job's business, only its exit counts
+bool JobsList::collectStray(pid_t pid)
+{
+  auto found = std::find(stray_pids.begin(), stray_pids.end(), pid);
+  if (found == stray_pids.end())
+    return false;
+  int status;
+  if (waitpid(pid, &status, WNOHANG | WUNTRACED | WCONTINUED) <= 0)
+    return false;
+  if (WIFEXITED(status) || WIFSIGNALED(status))
+  {
+    stray_pids.erase(found);
+    SmallShell::getInstance().GetTimesListReference().cancelTimeout(pid);
+    SmallShell::getInstance().GetCgroupListReference().release(pid);
+    SmallShell::getInstance().GetAffinityReference().release(pid);
+  }
+  return true;
+}
+
+// blocks until the job is stopped (or running again), taking the stops and
+// continues on the way. an exit ends the wait but is left for the sweep to
+// collect and record.
+void JobsList::waitForState(shared_ptr<JobEntry> job, bool stopped)
+{
+  while (job->isStopped() != stopped)
+  {
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, job->GetPid(), &info, WEXITED | WSTOPPED | WCONTINUED | WNOWAIT) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if (info.si_code != CLD_STOPPED && info.si_code != CLD_CONTINUED)
+      return;
+    info.si_pid = 0;
+    if (waitid(P_PID, job->GetPid(), &info, WSTOPPED | WCONTINUED | WNOHANG) == -1 || info.si_pid == 0)
+      return;
+    job->SetIsStopped(info.si_code == CLD_STOPPED);
+  }
+}
+
+std::shared_ptr<JobsList::JobEntry> JobsList::getLastJob()
+{
+  return jobs_list[max_job_id];
+}
+
+std::shared_ptr<JobsList::JobEntry> JobsList::getLastStoppedJob()
+{
+  for (int id = max_job_id; id > 0; id--)
+  {
+    if (jobs_list[id] && jobs_list[id]->isStopped())
+    {
+      return jobs_list[id];
+    }
+  }
+  return nullptr;
+}
+
+std::shared_ptr<JobsList::JobEntry> JobsList::getJobById(int jobId)
+{
+  if(jobId <= 0 || jobId > max_job_id) {
+    return nullptr;
+  }
+  return jobs_list[jobId];
+}
+
+std::shared_ptr<JobsList::JobEntry> JobsList::getJobByPid(pid_t pid)
+{
+  if(pid <= 0) {
+    return nullptr;
+  }
+  auto found = jobs_by_pid.find(pid);
+  if (found == jobs_by_pid.end())
+  {
+    return nullptr;
+  }
+  return found->second;
+}
+
+void JobsList::removeJobById(int jobId)
+{
+  if (jobId <= 0 || jobId > max_job_id || !jobs_list[jobId])
+  {
+    return;
+  }
+  jobs_by_pid.erase(jobs_list[jobId]->GetPid());
+  jobs_list[jobId] = nullptr;
+  num_jobs--;
+  if (jobId == max_job_id)
+  {
+    max_job_id = findMaxJobId();
+  }
+}
+
+// drops the empty slots above the highest job id still in use
+int JobsList::findMaxJobId()
+{
+  int max = max_job_id;
+  while (max > 0 && !jobs_list[max])
+  {
+    max--;
+  }
+  jobs_list.resize(max + 1);
+  return max;
+}
+
+JobsList::~JobsList()
+{
+  // for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir){
+  //   *ir = nullptr;
+  // }
+}
+
+JobsList::JobEntry::~JobEntry(){
+  // delete cmd;
+}
+
+/*----- TIMES LIST -----*/
+
+long long _monotonicMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// heap order: the entry that finishes first is on top
+bool _finishesLater(const shared_ptr<TimesList::TimeEntry> &a, const shared_ptr<TimesList::TimeEntry> &b)
+{
+  return a->GetFinishTime() > b->GetFinishTime();
+}
+
+TimesList::TimeEntry::TimeEntry() : pid(-1), cmd(NULL), init_time(0), finish_time(0), cancelled(false) {};
+
+TimesList::TimeEntry::TimeEntry(pid_t pid, shared_ptr<Command> cmd, long long init_time, long long finish_time) : pid(pid), cmd(cmd), init_time(init_time), finish_time(finish_time), cancelled(false) {};
+
+
+pid_t TimesList::TimeEntry::GetPid()
+{
+  return pid;
+}
+
+Command *TimesList::TimeEntry::GetCommand() 
+{
+  return cmd.get();
+}
+
+const char *TimesList::TimeEntry::GetCommandLine()
+{
+  return cmd->GetCmd_line();
+}
+
+long long TimesList::TimeEntry::GetDuration()
+{
+  return finish_time - init_time;
+}
+
+long long TimesList::TimeEntry::GetFinishTime()
+{
+  return finish_time;
+}
+
+bool TimesList::TimeEntry::isCancelled()
+{
+  return cancelled;
+}
+
+void TimesList::TimeEntry::Cancel()
+{
+  cancelled = true;
+}
+
+TimesList::TimesList() : timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+{
+  if (timer_fd == -1)
+  {
+    perror("smash error: timerfd_create failed");
+  }
+}
+
+TimesList::~TimesList()
+{
+  if (timer_fd != -1)
+    close(timer_fd);
+}
+
+int TimesList::GetTimerFd()
+{
+  return timer_fd;
+}
+
+void TimesList::addToTimesList(shared_ptr<Command> cmd, pid_t pid, long long duration_ms)
+{
+  long long init_time = _monotonicMs();
+  shared_ptr<TimeEntry> new_time(new TimeEntry(pid, cmd, init_time, init_time + duration_ms));
+  times_list.push_back(new_time);
+  std::push_heap(times_list.begin(), times_list.end(), _finishesLater);
+  times_by_pid[pid] = new_time;
+  armTimer();
+}
+
+void TimesList::cancelTimeout(pid_t pid)
+{
+  auto found = times_by_pid.find(pid);
+  if (found != times_by_pid.end())
+  {
+    found->second->Cancel();
+    times_by_pid.erase(found);
+    armTimer();
+  }
+}
+
+void TimesList::popCancelled()
+{
+  while (!times_list.empty() && times_list.front()->isCancelled())
+  {
+    std::pop_heap(times_list.begin(), times_list.end(), _finishesLater);
+    times_list.pop_back();
+  }
+}
+
+// points the timerfd at the closest live deadline, or disarms it
+void TimesList::armTimer()
+{
+  popCancelled();
+  struct itimerspec timer = {{0, 0}, {0, 0}};
+  if (!times_list.empty())
+  {
+    long long finish = times_list.front()->GetFinishTime();
+    timer.it_value.tv_sec = finish / 1000;
+    timer.it_value.tv_nsec = (finish % 1000) * 1000000;
+  }
+  DO_SYS(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL), "timerfd_settime");
+}
+
+void TimesList::killFinishedAlarms()
+{
+  long long curr_time = _monotonicMs();
+  popCancelled();
+  while (!times_list.empty() && times_list.front()->GetFinishTime() <= curr_time)
+  {
+    shared_ptr<TimeEntry> expired = times_list.front();
+    std::pop_heap(times_list.begin(), times_list.end(), _finishesLater);
+    times_list.pop_back();
+    times_by_pid.erase(expired->GetPid());
+    // a child that already exited (even if not reaped yet) did not time out
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, expired->GetPid(), &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0)
+    {
+      cout<< "smash: " << expired->GetCommandLine() << " timed out!" <<endl;
+      DO_SYS(kill(expired->GetPid(), SIGKILL), "kill");
+      SmallShell::getInstance().GetTraceLogReference().instant("timeout kill", "timeout", expired->GetPid(), expired->GetCommandLine());
+    }
+    popCancelled();
+  }
+  armTimer();
+}
+
+long long TimesList::GetClosestAlarm() {
+  popCancelled();
+  if (times_list.empty()){
+    return 0;
+  }
+  return times_list.front()->GetFinishTime() - _monotonicMs();
+}
+
+
+/*----- CGROUPS -----*/
+
+bool CgroupList::Limits::empty()
+{
+  return memory_max.empty() && cpu_max.empty() && pids_max.empty();
+}
+
+// --mem 512M|2G|bytes, --cpu cpus (1.5 is one and a half cores), --pids n.
+// "max" lifts a limit.
+bool CgroupList::Limits::parseOption(const char *option, const char *value)
+{
+  bool lift = strcmp(value, "max") == 0;
+  char *end;
+  if (strcmp(option, "--mem") == 0)
+  {
+    if (lift)
+    {
+      memory_max = "max";
+      return true;
+    }
+    double size = strtod(value, &end);
+    const char *units = "KMGT";
+    const char *unit = *end ? strchr(units, toupper(*end)) : NULL;
+    if (!(size > 0) || (*end && (!unit || end[1] != '\0')))
+      return false;
+    memory_max = to_string((long long)(size * (1LL << (unit ? 10 * (unit - units + 1) : 0))));
+    return true;
+  }
+  if (strcmp(option, "--cpu") == 0)
+  {
+    if (lift)
+    {
+      cpu_max = "max " + to_string(CGROUP_CPU_PERIOD_US);
+      return true;
+    }
+    double cpus = strtod(value, &end);
+    if (*end != '\0' || !(cpus > 0))
+      return false;
+    // the kernel takes no less than 1ms per period
+    long long quota = max((long long)(cpus * CGROUP_CPU_PERIOD_US + 0.5), 1000LL);
+    cpu_max = to_string(quota) + " " + to_string(CGROUP_CPU_PERIOD_US);
+    return true;
+  }
+  if (strcmp(option, "--pids") == 0)
+  {
+    if (lift)
+    {
+      pids_max = "max";
+      return true;
+    }
+    long pids = strtol(value, &end, 10);
+    if (*end != '\0' || pids <= 0)
+      return false;
+    pids_max = to_string(pids);
+    return true;
+  }
+  return false;
+}
+
+// the first line of a cgroup or sysfs file, empty on failure
+string _readFirstLine(const string &dir, const char *file)
+{
+  std::ifstream in(dir + "/" + file);
+  string line;
+  std::getline(in, line);
+  return line;
+}
+
+CgroupList::CgroupList() : max_cgroup_id(0), owner(getpid()) {}
+
+CgroupList::~CgroupList()
+{
+  if (root.empty() || getpid() != owner)
+    return;
+  for (auto ir = cgroups_by_pid.begin(); ir != cgroups_by_pid.end(); ++ir)
+    removeCgroup(ir->second);
+  for (auto ir = lingering.begin(); ir != lingering.end(); ++ir)
+    removeCgroup(*ir);
+  if (!shell_leaf.empty())
+  {
+    // back to base, which takes no process while it hands controllers down
+    const char *controllers[] = {"-memory", "-cpu", "-pids"};
+    for (int i = 0; i < 3; i++)
+      _writeCgroupFile(root, "cgroup.subtree_control", controllers[i], false);
+    for (auto ir = base_controllers.begin(); ir != base_controllers.end(); ++ir)
+      _writeCgroupFile(base, "cgroup.subtree_control", "-" + *ir, false);
+    _writeCgroupFile(base, "cgroup.procs", "0", false);
+    removeCgroup(shell_leaf);
+  }
+  removeCgroup(root);
+}
+
+// finds the base cgroup and makes the shell's subtree under it, once
+bool CgroupList::setup()
+{
+  if (!root.empty())
+    return true;
+  // the cgroup2 mount point, and the shell's cgroup ("0::/path") under it
+  string mount_point;
+  std::ifstream mounts("/proc/self/mounts");
+  for (string line; mount_point.empty() && std::getline(mounts, line);)
+  {
+    std::istringstream fields(line);
+    string device, dir, type;
+    if (fields >> device >> dir >> type && type == "cgroup2")
+      mount_point = dir;
+  }
+  string own_path;
+  std::ifstream own("/proc/self/cgroup");
+  for (string line; std::getline(own, line);)
+  {
+    if (line.compare(0, 3, "0::") == 0)
+      own_path = line.substr(3);
+  }
+  string own_dir;
+  if (!mount_point.empty() && !own_path.empty())
+    own_dir = mount_point + (own_path == "/" ? "" : own_path);
+  const char *env_base = getenv("SMASH_CGROUP");
+  string new_base = (env_base && *env_base) ? env_base : own_dir;
+  if (new_base.empty())
+  {
+    cerr << "smash error: limit: no cgroup v2 hierarchy" << endl;
+    return false;
+  }
+  string new_root = new_base + "/smash-" + to_string(owner);
+  if (mkdir(new_root.c_str(), 0755) == -1 && errno != EEXIST)
+  {
+    perror("smash error: mkdir failed");
+    return false;
+  }
+  // a cgroup holding processes cannot hand controllers down (the root
+  // cgroup aside), so the shell moves out of the base into a leaf of its own
+  if (new_base == own_dir && own_path != "/")
+  {
+    string leaf = new_root + "/shell";
+    if (mkdir(leaf.c_str(), 0755) == -1 && errno != EEXIST)
+    {
+      perror("smash error: mkdir failed");
+      removeCgroup(new_root);
+      return false;
+    }
+    if (!_writeCgroupFile(leaf, "cgroup.procs", "0"))
+    {
+      removeCgroup(leaf);
+      removeCgroup(new_root);
+      return false;
+    }
+    shell_leaf = leaf;
+  }
+  // hand down whichever controllers the base has. a controller that is
+  // missing shows up as an error once a limit needs it
+  string enabled = " " + _readFirstLine(new_base, "cgroup.subtree_control") + " ";
+  const char *controllers[] = {"memory", "cpu", "pids"};
+  bool handed_down = false;
+  for (int i = 0; i < 3; i++)
+  {
+    string name = controllers[i];
+    if (enabled.find(" " + name + " ") != string::npos)
+      handed_down = true;
+    else if (_writeCgroupFile(new_base, "cgroup.subtree_control", "+" + name, false))
+    {
+      base_controllers.push_back(name);
+      handed_down = true;
+    }
+    _writeCgroupFile(new_root, "cgroup.subtree_control", "+" + name, false);
+  }
+  // with none handed down the shell had no reason to leave the base
+  if (!handed_down && !shell_leaf.empty() && _writeCgroupFile(new_base, "cgroup.procs", "0", false))
+  {
+    removeCgroup(shell_leaf);
+    shell_leaf.clear();
+  }
+  base = new_base;
+  root = new_root;
+  return true;
+}
+
+// limits are only written where the controller reaches, with a hint when it
+// does not
+bool CgroupList::hasController(const char *name)
+{
+  string enabled = " " + _readFirstLine(root, "cgroup.subtree_control") + " ";
+  if (enabled.find(" " + string(name) + " ") != string::npos)
+    return true;
+  cerr << "smash error: limit: the " << name << " controller is not available, run smash in a delegated cgroup or set SMASH_CGROUP to one" << endl;
+  return false;
+}
+
+bool CgroupList::removeCgroup(const string &path)
+{
+  return rmdir(path.c_str()) == 0 || errno == ENOENT;
+}
+
+string CgroupList::create(const Limits &limits)
+{
+  if (!setup())
+    return "";
+  string path = root + "/job-" + to_string(++max_cgroup_id);
+  if (mkdir(path.c_str(), 0755) == -1)
+  {
+    perror("smash error: mkdir failed");
+    return "";
+  }
+  if (!setLimits(path, limits))
+  {
+    removeCgroup(path);
+    return "";
+  }
+  return path;
+}
+
+bool CgroupList::setLimits(const string &path, const Limits &limits)
+{
+  if (!limits.memory_max.empty() && (!hasController("memory") || !_writeCgroupFile(path, "memory.max", limits.memory_max)))
+    return false;
+  if (!limits.cpu_max.empty() && (!hasController("cpu") || !_writeCgroupFile(path, "cpu.max", limits.cpu_max)))
+    return false;
+  if (!limits.pids_max.empty() && (!hasController("pids") || !_writeCgroupFile(path, "pids.max", limits.pids_max)))
+    return false;
+  return true;
+}
+
+void CgroupList::add(pid_t pid, const string &path)
+{
+  cgroups_by_pid[pid] = path;
+}
+
+// the process was reaped: its cgroup goes once nothing it started is left in
+// it. cgroups that are still busy are retried on every release.
+void CgroupList::release(pid_t pid)
+{
+  auto found = cgroups_by_pid.find(pid);
+  if (found == cgroups_by_pid.end() && lingering.empty())
+    return;
+  if (found != cgroups_by_pid.end())
+  {
+    lingering.push_back(found->second);
+    cgroups_by_pid.erase(found);
+  }
+  vector<string> busy;
+  for (auto ir = lingering.begin(); ir != lingering.end(); ++ir)
+  {
+    if (!removeCgroup(*ir))
+      busy.push_back(*ir);
+  }
+  lingering.swap(busy);
+}
+
+string CgroupList::find(pid_t pid)
+{
+  auto found = cgroups_by_pid.find(pid);
+  if (found == cgroups_by_pid.end())
+    return "";
+  return found->second;
+}
+
+// false if the process has no cgroup or the kernel has no cgroup.kill (5.14+)
+bool CgroupList::killAll(pid_t pid)
+{
+  string path = find(pid);
+  return !path.empty() && _writeCgroupFile(path, "cgroup.kill", "1", false);
+}
+
+// a byte count from a cgroup file in kB, "max" as is
+string _cgroupKb(const string &bytes)
+{
+  if (bytes.empty() || !isdigit(bytes[0]))
+    return bytes;
+  return to_string(stoll(bytes) / 1024) + "kB";
+}
+
+// jobs -l: what the job's cgroup as a whole uses, next to its limits
+void CgroupList::printUsage(pid_t pid)
+{
+  string path = find(pid);
+  if (path.empty())
+    return;
+  // each controller's numbers, if the cgroup has that controller
+  cout << " cgroup";
+  string memory = _readFirstLine(path, "memory.current");
+  if (!memory.empty())
+    cout << " mem " << _cgroupKb(memory) << "/" << _cgroupKb(_readFirstLine(path, "memory.max"));
+  std::ifstream cpu_stat(path + "/cpu.stat");
+  string key;
+  long long usage_us;
+  while (cpu_stat >> key >> usage_us)
+  {
+    if (key == "usage_usec")
+    {
+      cout << fixed << setprecision(2) << " cpu " << usage_us / 1e6 << "s" << defaultfloat;
+      break;
+    }
+  }
+  string pids = _readFirstLine(path, "pids.current");
+  if (!pids.empty())
+    cout << " pids " << pids << "/" << _readFirstLine(path, "pids.max");
+  std::ifstream events(path + "/memory.events");
+  long long count;
+  while (events >> key >> count)
+  {
+    if (key == "oom_kill" && count > 0)
+      cout << " oom-kills " << count;
+  }
+}
+
+LimitCommand::LimitCommand(const char *cmd_line) : BuiltInCommand(cmd_line), pid(-1), job_id(0), cmd_word(0), valid(false)
+{
+  CommandArgs &args = GetArgs();
+  int i = 1;
+  if (args[i] && strcmp(args[i], "-j") == 0)
+  {
+    if (!args[i + 1] || atoi(args[i + 1]) <= 0)
+      return;
+    job_id = atoi(args[i + 1]);
+    i += 2;
+  }
+  for (; args[i] && strncmp(args[i], "--", 2) == 0; i += 2)
+  {
+    if (!args[i + 1] || !limits.parseOption(args[i], args[i + 1]))
+      return;
+  }
+  // either a command to start or a job to change, and something to set
+  if (limits.empty() || (job_id != 0) == (args[i] != NULL))
+    return;
+  cmd_word = job_id ? 0 : i;
+  valid = true;
+}
+REGISTER_BUILTIN("limit", LimitCommand);
+
+bool LimitCommand::hasCommand()
+{
+  return valid && cmd_word != 0;
+}
+
+// limit -j: the command form is started through spawn
+void LimitCommand::execute()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  if (!valid)
+  {
+    cerr << "smash error: limit: invalid arguments" << endl;
+    smash.SetLastStatus(1);
+    return;
+  }
+  shared_ptr<JobsList::JobEntry> job = smash.GetJobsListReference().getJobById(job_id);
+  if (!job)
+  {
+    cerr << "smash error: limit: job-id " << job_id << " does not exist" << endl;
+    smash.SetLastStatus(1);
+    return;
+  }
+  CgroupList &cgroups = smash.GetCgroupListReference();
+  string path = cgroups.find(job->GetPid());
+  if (path.empty())
+  {
+    cerr << "smash error: limit: job-id " << job_id << " was not started with limit" << endl;
+    smash.SetLastStatus(1);
+    return;
+  }
+  if (!cgroups.setLimits(path, limits))
+    smash.SetLastStatus(1);
+}
+
+pid_t LimitCommand::spawn(RedirectionList &fds, pid_t pgid)
+{
+  CgroupList &cgroups = SmallShell::getInstance().GetCgroupListReference();
+  string cgroup = cgroups.create(limits);
+  if (cgroup.empty())
+    return -1;
+  LaunchSetup setup;
+  setup.cgroup = cgroup.c_str();
+  pid_t new_pid = _spawnCommandLine(this, cmd_word, fds, pgid, setup);
+  if (new_pid == -1)
+  {
+    rmdir(cgroup.c_str());
+    return -1;
+  }
+  cgroups.add(new_pid, cgroup);
+  return new_pid;
+}
+
+void LimitCommand::SetPid(pid_t new_pid)
+{
+  pid = new_pid;
+}
+
+pid_t LimitCommand::GetPid()
+{
+  return pid;
+}
+
+/*----- CPU AFFINITY -----*/
+
+// "0-3,8,10-11" into cpu numbers, in order and without repeats
+bool _parseCpuList(const char *list, vector<int> &cpus)
+{
+  cpus.clear();
+  const char *pos = list;
+  while (*pos)
+  {
+    char *end;
+    long first = strtol(pos, &end, 10);
+    if (end == pos || first < 0)
+      return false;
+    long last = first;
+    if (*end == '-')
+    {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if (end == pos || last < first)
+        return false;
+    }
+    if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0'))
+      return false;
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back((int)cpu);
+    pos = (*end == ',') ? end + 1 : end;
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return !cpus.empty();
+}
+
+string _formatCpuList(const vector<int> &cpus)
+{
+  string list;
+  for (size_t i = 0; i < cpus.size();)
+  {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+      j++;
+    list += (list.empty() ? "" : ",") + to_string(cpus[i]);
+    if (j > i)
+      list += "-" + to_string(cpus[j]);
+    i = j + 1;
+  }
+  return list;
+}
+
+AffinityList::AffinityList() : policy(AFFINITY_NONE), loaded(false) {}
+
+const char *AffinityList::policyName(Policy policy)
+{
+  static const char *names[] = {"none", "spread", "compact"};
+  return names[policy];
+}
+
+bool AffinityList::parsePolicy(const char *name, Policy *policy)
+{
+  for (int i = AFFINITY_NONE; i <= AFFINITY_COMPACT; i++)
+  {
+    if (strcmp(name, policyName((Policy)i)) == 0)
+    {
+      *policy = (Policy)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+AffinityList::Policy AffinityList::GetPolicy()
+{
+  return policy;
+}
+
+void AffinityList::SetPolicy(Policy new_policy)
+{
+  policy = new_policy;
+}
+
+// the cores the shell may use, from its own affinity mask, the NUMA nodes'
+// cpulists and each cpu's hardware thread siblings. without the node
+// directories (no NUMA) everything is node 0.
+void AffinityList::loadTopology()
+{
+  loaded = true;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+  {
+    perror("smash error: sched_getaffinity failed");
+    return;
+  }
+  vector<int> nodes;
+  string online = _readFirstLine("/sys/devices/system/node", "online");
+  if (online.empty() || !_parseCpuList(online.c_str(), nodes))
+    nodes.assign(1, 0);
+  vector<int> cpu_node(CPU_SETSIZE, nodes.front());
+  for (auto node = nodes.begin(); node != nodes.end(); ++node)
+  {
+    vector<int> cpus;
+    string list = _readFirstLine("/sys/devices/system/node/node" + to_string(*node), "cpulist");
+    if (list.empty() || !_parseCpuList(list.c_str(), cpus))
+      continue;
+    for (auto cpu = cpus.begin(); cpu != cpus.end(); ++cpu)
+      cpu_node[*cpu] = *node;
+  }
+  node_jobs.assign(nodes.back() + 1, 0);
+  vector<bool> placed(CPU_SETSIZE, false);
+  for (auto node = nodes.begin(); node != nodes.end(); ++node)
+  {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (!CPU_ISSET(cpu, &allowed) || placed[cpu] || cpu_node[cpu] != *node)
+        continue;
+      Core core = {*node, {}, 0};
+      vector<int> siblings;
+      string list = _readFirstLine("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology", "thread_siblings_list");
+      if (list.empty() || !_parseCpuList(list.c_str(), siblings))
+        siblings.assign(1, cpu);
+      for (auto sibling = siblings.begin(); sibling != siblings.end(); ++sibling)
+      {
+        if (CPU_ISSET(*sibling, &allowed) && !placed[*sibling])
+        {
+          placed[*sibling] = true;
+          core.cpus.push_back(*sibling);
+        }
+      }
+      cores.push_back(core);
+    }
+  }
+}
+
+// the least busy core; spread breaks ties by the least busy node, compact
+// by the lowest node, both then by the lowest cpu
+bool AffinityList::pick(Assignment &assignment)
+{
+  if (policy == AFFINITY_NONE)
+    return false;
+  if (!loaded)
+    loadTopology();
+  int best = -1;
+  for (int i = 0; i < (int)cores.size(); i++)
+  {
+    if (best == -1 || cores[i].jobs < cores[best].jobs)
+    {
+      best = i;
+      continue;
+    }
+    if (policy == AFFINITY_SPREAD && cores[i].jobs == cores[best].jobs && node_jobs[cores[i].node] < node_jobs[cores[best].node])
+      best = i;
+  }
+  if (best == -1)
+    return false;
+  assignment.cpus = cores[best].cpus;
+  assignment.core = best;
+  return true;
+}
+
+void AffinityList::add(pid_t pid, const Assignment &assignment)
+{
+  if (assignment.core != -1)
+  {
+    cores[assignment.core].jobs++;
+    node_jobs[cores[assignment.core].node]++;
+  }
+  assignments[pid] = assignment;
+}
+
+void AffinityList::release(pid_t pid)
+{
+  auto found = assignments.find(pid);
+  if (found == assignments.end())
+    return;
+  int core = found->second.core;
+  if (core != -1)
+  {
+    cores[core].jobs--;
+    node_jobs[cores[core].node]--;
+  }
+  assignments.erase(found);
+}
+
+string AffinityList::describe(pid_t pid)
+{
+  auto found = assignments.find(pid);
+  if (found == assignments.end())
+    return "";
+  string description = "cpus " + _formatCpuList(found->second.cpus);
+  if (found->second.core == -1)
+    description += " (pinned)";
+  else if (node_jobs.size() > 1)
+    description += " node " + to_string(cores[found->second.core].node);
+  return description;
+}
+
+PinCommand::PinCommand(const char *cmd_line) : BuiltInCommand(cmd_line), pid(-1), valid(false)
+{
+  CommandArgs &args = GetArgs();
+  valid = args.size() >= 3 && _parseCpuList(args[1], cpus);
+}
+REGISTER_BUILTIN("pin", PinCommand);
+
+bool PinCommand::hasCommand()
+{
+  return valid;
+}
+
+// valid pins are started through spawn
+void PinCommand::execute()
+{
+  cerr << "smash error: pin: invalid arguments" << endl;
+  SmallShell::getInstance().SetLastStatus(1);
+}
+
+// the child is on its cpus before its exec
+pid_t PinCommand::spawn(RedirectionList &fds, pid_t pgid)
+{
+  LaunchSetup setup;
+  setup.cpus = &cpus;
+  pid_t new_pid = _spawnCommandLine(this, 2, fds, pgid, setup);
+  if (new_pid != -1)
+  {
+    AffinityList::Assignment assignment = {cpus, -1};
+    SmallShell::getInstance().GetAffinityReference().add(new_pid, assignment);
+  }
+  return new_pid;
+}
+
+void PinCommand::SetPid(pid_t new_pid)
+{
+  pid = new_pid;
+}
+
+pid_t PinCommand::GetPid()
+{
+  return pid;
+}
+
+/*----- SCHEDULING -----*/
+
+LaunchPriority::LaunchPriority() : has_nice(false), nice(0), policy(-1), ioprio(-1) {}
+
+bool LaunchPriority::empty()
+{
+  return !has_nice && policy == -1 && ioprio == -1;
+}
+
+bool LaunchPriority::parseNice(const char *adjustment)
+{
+  char *end;
+  long value = strtol(adjustment, &end, 10);
+  if (*adjustment == '\0' || *end != '\0' || value < -40 || value > 40)
+    return false;
+  has_nice = true;
+  nice = (int)value;
+  return true;
+}
+
+bool LaunchPriority::parsePolicy(const char *name)
+{
+  const int policies[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE};
+  for (int i = 0; i < 3; i++)
+  {
+    if (strcmp(name, policyName(policies[i])) == 0)
+    {
+      policy = policies[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+// realtime|rt|1, best-effort|be|2 or idle|3, with a level from 0 (first
+// served) to 7. realtime needs root.
+bool LaunchPriority::parseIoPriority(const string &io_class, const char *level)
+{
+  int class_id;
+  if (io_class == "realtime" || io_class == "rt" || io_class == "1")
+    class_id = IOPRIO_CLASS_RT;
+  else if (io_class == "best-effort" || io_class == "be" || io_class == "2")
+    class_id = IOPRIO_CLASS_BE;
+  else if (io_class == "idle" || io_class == "3")
+    class_id = IOPRIO_CLASS_IDLE;
+  else
+    return false;
+  int data = (class_id == IOPRIO_CLASS_IDLE) ? 0 : IOPRIO_NORM;
+  if (level)
+  {
+    char *end;
+    long value = strtol(level, &end, 10);
+    if (*level == '\0' || *end != '\0' || value < 0 || value >= IOPRIO_NR_LEVELS)
+      return false;
+    data = (class_id == IOPRIO_CLASS_IDLE) ? 0 : (int)value;
+  }
+  ioprio = IOPRIO_PRIO_VALUE(class_id, data);
+  return true;
+}
+
+// class[/level], as ionice and set ionice take it
+bool LaunchPriority::parseIoSpec(const char *spec)
+{
+  string io_class(spec);
+  size_t slash = io_class.find('/');
+  if (slash == string::npos)
+    return parseIoPriority(io_class, NULL);
+  return parseIoPriority(io_class.substr(0, slash), spec + slash + 1);
+}
+
+LaunchPriority LaunchPriority::withDefaults(const LaunchPriority &defaults) const
+{
+  LaunchPriority merged = *this;
+  if (!has_nice)
+  {
+    merged.has_nice = defaults.has_nice;
+    merged.nice = defaults.nice;
+  }
+  if (policy == -1)
+    merged.policy = defaults.policy;
+  if (ioprio == -1)
+    merged.ioprio = defaults.ioprio;
+  return merged;
+}
+
+// posix_spawn can set the policy alone
+bool LaunchPriority::needsChild() const
+{
+  return has_nice || ioprio != -1;
+}
+
+const char *LaunchPriority::policyName(int policy)
+{
+  if (policy == SCHED_BATCH)
+    return "batch";
+  if (policy == SCHED_IDLE)
+    return "idle";
+  return "other";
+}
+
+string LaunchPriority::ioPriorityName(int ioprio)
+{
+  int class_id = IOPRIO_PRIO_CLASS(ioprio);
+  if (class_id == IOPRIO_CLASS_IDLE)
+    return "idle";
+  return string(class_id == IOPRIO_CLASS_RT ? "realtime" : "best-effort") + "/" + to_string(IOPRIO_PRIO_DATA(ioprio));
+}
+
+// one nice, sched or ionice of a chain, from its i-th word: the word past
+// its options, or 0 if they are not one of its launch forms
+int _parsePriorityLink(CommandArgs &args, int i, LaunchPriority &priority)
+{
+  if (strcmp(args[i], "nice") == 0)
+  {
+    // chained ones add up, as nice run by nice does
+    int before = priority.has_nice ? priority.nice : 0;
+    bool adjusted = args[i + 1] && strcmp(args[i + 1], "-n") == 0;
+    if (!priority.parseNice(adjusted ? (args[i + 2] ? args[i + 2] : "") : "10"))
+      return 0;
+    priority.nice += before;
+    return i + (adjusted ? 3 : 1);
+  }
+  if (strcmp(args[i], "sched") == 0)
+    return (args[i + 1] && priority.parsePolicy(args[i + 1])) ? i + 2 : 0;
+  if (strcmp(args[i], "ionice") == 0)
+  {
+    if (args[i + 1] && strcmp(args[i + 1], "-c") == 0)
+    {
+      if (!args[i + 2])
+        return 0;
+      const char *level = NULL;
+      if (args[i + 3] && strcmp(args[i + 3], "-n") == 0)
+        level = args[i + 4] ? args[i + 4] : "";
+      return priority.parseIoPriority(args[i + 2], level) ? i + (level ? 5 : 3) : 0;
+    }
+    return (args[i + 1] && priority.parseIoSpec(args[i + 1])) ? i + 2 : 0;
+  }
+  return 0;
+}
+
+PriorityCommand::PriorityCommand(const char *cmd_line) : BuiltInCommand(cmd_line), pid(-1), cmd_word(0)
+{
+  CommandArgs &args = GetArgs();
+  // a link only counts with a command after it, so in nice -n 5 nice the
+  // second nice is the command. an option where the command should be
+  // (nice -5, ionice -c 3 -p pid) is not a launch form at all
+  int i = 0;
+  while (true)
+  {
+    LaunchPriority linked = priority;
+    int next = _parsePriorityLink(args, i, linked);
+    if (next == 0 || !args[next] || args[next][0] == '-')
+      break;
+    priority = linked;
+    i = next;
+  }
+  if (i > 0)
+    cmd_word = i;
+}
+
+// the launch forms are the built-in's. the rest (nice alone, nice -5,
+// ionice -p pid) are the system nice's and ionice's
+Command *_createPriorityCommand(const char *cmd_line)
+{
+  CommandArena &arena = SmallShell::getInstance().GetCommandArena();
+  PriorityCommand *cmd = arena.create<PriorityCommand>(cmd_line);
+  if (cmd->hasCommand() || strcmp(cmd->GetArgs()[0], "sched") == 0)
+    return cmd;
+  return arena.create<ExternalCommand>(cmd_line);
+}
+REGISTER_BUILTIN_FACTORY("nice", _createPriorityCommand);
+REGISTER_BUILTIN_FACTORY("sched", _createPriorityCommand);
+REGISTER_BUILTIN_FACTORY("ionice", _createPriorityCommand);
+
+bool PriorityCommand::hasCommand()
+{
+  return cmd_word != 0;
+}
+
+// valid ones are started through spawn, invalid nice and ionice run the
+// system's
+void PriorityCommand::execute()
+{
+  cerr << "smash error: " << GetArgs()[0] << ": invalid arguments" << endl;
+  SmallShell::getInstance().SetLastStatus(1);
+}
+
+pid_t PriorityCommand::spawn(RedirectionList &fds, pid_t pgid)
+{
+  LaunchSetup setup;
+  setup.priority = priority;
+  return _spawnCommandLine(this, cmd_word, fds, pgid, setup);
+}
+
+void PriorityCommand::SetPid(pid_t new_pid)
+{
+  pid = new_pid;
+}
+
+pid_t PriorityCommand::GetPid()
+{
+  return pid;
+}
+
+ReniceCommand::ReniceCommand(const char *cmd_line, JobsList &jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+
+Command *_createReniceCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  return smash.GetCommandArena().create<ReniceCommand>(cmd_line, smash.GetJobsListReference());
+}
+REGISTER_BUILTIN_FACTORY("renice", _createReniceCommand);
+
+void ReniceCommand::execute()
+{
+  CommandArgs &args = GetArgs();
+  int first = (args[1] && strcmp(args[1], "-n") == 0) ? 2 : 1;
+  char *end = NULL;
+  long value = (args.size() == first + 2) ? strtol(args[first], &end, 10) : 0;
+  if (!end || *end != '\0' || *args[first] == '\0' || atoi(args[first + 1]) <= 0)
+  {
+    cerr << "smash error: renice: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
   }
-  int status;
-  DO_SYS(waitpid(cur_job->GetPid(), &status, WUNTRACED), "waitpid");
-  if (WIFSTOPPED(status))
+  shared_ptr<JobsList::JobEntry> job = jobs.getJobById(atoi(args[first + 1]));
+  if (!job)
+  {
+    cerr << "smash error: renice: job-id " << args[first + 1] << " does not exist" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  // everything the job started is in its process group
+  pid_t pgid = getpgid(job->GetPid());
+  DO_SYS(pgid, "getpgid");
+  errno = 0;
+  int old_value = getpriority(PRIO_PGRP, pgid);
+  DO_SYS((old_value == -1 && errno) ? -1 : 0, "getpriority");
+  int new_value = max(-20L, min(19L, value));
+  DO_SYS(setpriority(PRIO_PGRP, pgid, new_value), "setpriority");
+  cout << pgid << " (process group ID) old priority " << old_value << ", new priority " << new_value << '\n';
+}
+
+SetOptionCommand::SetOptionCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("set", SetOptionCommand);
+
+void SetOptionCommand::execute()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  AffinityList &affinity = smash.GetAffinityReference();
+  LaunchPriority &background = smash.GetBackgroundPriorityReference();
+  CommandArgs &args = GetArgs();
+  const char *names[] = {"affinity", "nice", "sched", "ionice"};
+  string values[] = {
+    AffinityList::policyName(affinity.GetPolicy()),
+    background.has_nice ? to_string(background.nice) : "none",
+    background.policy != -1 ? LaunchPriority::policyName(background.policy) : "none",
+    background.ioprio != -1 ? LaunchPriority::ioPriorityName(background.ioprio) : "none"};
+  // set prints every option, set name prints one
+  if (args.size() <= 2)
+  {
+    bool found = false;
+    for (int i = 0; i < 4; i++)
+    {
+      if (args[1] && strcmp(args[1], names[i]) != 0)
+        continue;
+      found = true;
+      cout << names[i] << " " << values[i] << '\n';
+    }
+    if (found)
+      return;
+  }
+  bool valid = args.size() == 3;
+  bool unset = valid && strcmp(args[2], "none") == 0;
+  LaunchPriority parsed;
+  AffinityList::Policy policy;
+  if (valid && strcmp(args[1], "affinity") == 0 && AffinityList::parsePolicy(args[2], &policy))
+  {
+    affinity.SetPolicy(policy);
+  }
+  else if (valid && strcmp(args[1], "nice") == 0 && (unset || parsed.parseNice(args[2])))
+  {
+    background.has_nice = parsed.has_nice;
+    background.nice = parsed.nice;
+  }
+  else if (valid && strcmp(args[1], "sched") == 0 && (unset || parsed.parsePolicy(args[2])))
+  {
+    background.policy = parsed.policy;
+  }
+  else if (valid && strcmp(args[1], "ionice") == 0 && (unset || parsed.parseIoSpec(args[2])))
+  {
+    background.ioprio = parsed.ioprio;
+  }
+  else
+  {
+    cerr << "smash error: set: invalid arguments" << endl;
+    smash.SetLastStatus(1);
+  }
+}
+
+/*----- PATH CACHE -----*/
+
+PathCache::PathEntry::PathEntry() : path(""), hits(0) {};
+
+PathCache::PathEntry::PathEntry(std::string path) : path(path), hits(0) {};
+
+const std::string &PathCache::PathEntry::GetPath()
+{
+  return path;
+}
+
+bool PathCache::PathEntry::isMiss()
+{
+  return path.empty();
+}
+
+int PathCache::PathEntry::GetHits()
+{
+  return hits;
+}
+
+void PathCache::PathEntry::AddHit()
+{
+  hits++;
+}
+
+PathCache::PathCache() : path_var(""), last_check(0) {}
+
+void PathCache::clear()
+{
+  entries.clear();
+}
+
+void PathCache::forget(const std::string &name)
+{
+  entries.erase(name);
+}
+
+// drops everything once PATH or one of its directories changed. the
+// directories are stat'ed at most every PATH_CACHE_RECHECK_SECS seconds so a
+// hit stays cheap even with a long (or network mounted) PATH.
+void PathCache::checkValid()
+{
+  const char *path_env = getenv("PATH");
+  if (!path_env)
+    path_env = "";
+  if (path_var != path_env)
+  {
+    entries.clear();
+    path_var = path_env;
+    dirs.clear();
+    size_t start = 0;
+    while (true)
+    {
+      size_t end = path_var.find(':', start);
+      string dir = path_var.substr(start, end == string::npos ? string::npos : end - start);
+      dirs.push_back(dir.empty() ? "." : dir);
+      if (end == string::npos)
+        break;
+      start = end + 1;
+    }
+    dir_mtimes.assign(dirs.size(), 0);
+    last_check = 0;
+  }
+  time_t now = time(NULL);
+  if (now - last_check < PATH_CACHE_RECHECK_SECS)
+  {
+    return;
+  }
+  last_check = now;
+  for (size_t i = 0; i < dirs.size(); i++)
+  {
+    struct stat dir_stat;
+    time_t mtime = (stat(dirs[i].c_str(), &dir_stat) == 0) ? dir_stat.st_mtime : 0;
+    if (mtime != dir_mtimes[i])
+    {
+      dir_mtimes[i] = mtime;
+      entries.clear();
+    }
+  }
+}
+
+std::string PathCache::search(const std::string &name)
+{
+  for (auto ir = dirs.begin(); ir != dirs.end(); ++ir)
+  {
+    string candidate = *ir + "/" + name;
+    struct stat file_stat;
+    if (stat(candidate.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode) && access(candidate.c_str(), X_OK) == 0)
+    {
+      return candidate;
+    }
+  }
+  return "";
+}
+
+// the name goes through a buffer kept between calls, so a hit allocates
+// nothing. the result is good until the next lookup.
+const std::string &PathCache::lookup(const char *name)
+{
+  key = name;
+  if (key.find('/') != string::npos)
+  {
+    return key;
+  }
+  checkValid();
+  auto found = entries.find(key);
+  if (found == entries.end())
+  {
+    // misses are cached as well
+    found = entries.insert(make_pair(key, PathEntry(search(key)))).first;
+  }
+  found->second.AddHit();
+  return found->second.GetPath();
+}
+
+bool PathCache::add(const std::string &name)
+{
+  checkValid();
+  string path = search(name);
+  if (path.empty())
+  {
+    return false;
+  }
+  entries[name] = PathEntry(path);
+  return true;
+}
+
+void PathCache::printPathCache()
+{
+  checkValid();
+  bool empty = true;
+  for (auto ir = entries.begin(); ir != entries.end(); ++ir)
+  {
+    if (ir->second.isMiss())
+      continue;
+    if (empty)
+      cout << "hits\tcommand\n";
+    empty = false;
+    cout << setw(4) << ir->second.GetHits() << "\t" << ir->second.GetPath() << '\n';
+  }
+  if (empty)
+  {
+    cout << "smash: hash: hash table empty" << endl;
+  }
+}
+
+HashCommand::HashCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("hash", HashCommand);
+
+void HashCommand::execute()
+{
+  PathCache &cache = SmallShell::getInstance().GetPathCacheReference();
+  CommandArgs &args = GetArgs();
+  int num_args = args.size();
+  if (num_args == 1)
+  {
+    cache.printPathCache();
+    return;
+  }
+  if (strcmp(args[1], "-r") == 0)
+  {
+    cache.clear();
+    return;
+  }
+  if (strcmp(args[1], "-d") == 0)
+  {
+    for (int i = 2; i < num_args; i++)
+      cache.forget(args[i]);
+    return;
+  }
+  for (int i = 1; i < num_args; i++)
+  {
+    if (!cache.add(args[i]))
+    {
+      cerr << "smash error: hash: " << args[i] << ": not found" << endl;
+      SmallShell::getInstance().SetLastStatus(1);
+    }
+  }
+}
+
+/*----- PARALLEL COMMAND -----*/
+
+ParallelCommand::ParallelCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("parallel", ParallelCommand);
+
+ParallelCommand::Task::Task(std::string cmd_line) : cmd_line(cmd_line), pid(-1), pid_fd(-1), job_id(-1), start(0), finish(0), exit_status(-1), stopped(false) {}
+
+// parallel [-j N] cmd [args...] ::: input... (or one input per line of stdin)
+void ParallelCommand::execute()
+{
+  CommandArgs &args = GetArgs();
+  int num_args = args.size();
+  int max_running = sysconf(_SC_NPROCESSORS_ONLN);
+  int first = 1;
+  if (args[1] && strcmp(args[1], "-j") == 0)
+  {
+    max_running = args[2] ? atoi(args[2]) : 0;
+    first = 3;
+  }
+  int separator = first;
+  while (separator < num_args && strcmp(args[separator], ":::") != 0)
+    separator++;
+  if (max_running <= 0 || first >= separator)
+  {
+    cerr << "smash error: parallel: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  string base;
+  for (int i = first; i < separator; i++)
+    base += string(i == first ? "" : " ") + args[i];
+  vector<Task> tasks;
+  if (separator < num_args)
+  {
+    for (int i = separator + 1; i < num_args; i++)
+      tasks.push_back(Task(base + " " + args[i]));
+  }
+  else
+  {
+    string input;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(0, buffer, sizeof(buffer))) > 0)
+      input.append(buffer, count);
+    std::istringstream lines(input);
+    for (string line; std::getline(lines, line);)
+    {
+      if (!_trim(line).empty())
+        tasks.push_back(Task(base + " " + _trim(line)));
+    }
+  }
+  run(tasks, max_running);
+  for (size_t i = 0; i < tasks.size(); i++)
+  {
+    cout << "[" << i + 1 << "] " << tasks[i].cmd_line << " : ";
+    if (tasks[i].pid == -1)
+      cout << "not started\n";
+    else if (tasks[i].stopped)
+      cout << "stopped (job " << tasks[i].job_id << ")\n";
+    else
+      cout << "exit " << tasks[i].exit_status << " " << fixed << setprecision(3) << (tasks[i].finish - tasks[i].start) / 1000.0 << defaultfloat << " secs\n";
+  }
+}
+
+vector<pid_t> ParallelCommand::GetForegroundPids()
+{
+  vector<pid_t> pids;
+  for (auto ir = running.begin(); ir != running.end(); ++ir)
+    pids.push_back((*ir)->pid);
+  return pids;
+}
+
+// after ctrl-C/ctrl-Z: waits for every running task to die or stop. the
+// stopped ones stay in the jobs list for fg/bg.
+void ParallelCommand::collectStopped()
+{
+  SmallShell &smash = SmallShell::getInstance();
+  JobsList &jobs = smash.GetJobsListReference();
+  for (auto ir = running.begin(); ir != running.end(); ++ir)
+  {
+    Task *task = *ir;
+    int status;
+    struct rusage usage;
+    if (task->pid_fd != -1)
+      close(task->pid_fd);
+    if (wait4(task->pid, &status, WUNTRACED, &usage) != task->pid)
+      continue;
+    shared_ptr<JobsList::JobEntry> job = jobs.getJobById(task->job_id);
+    if (WIFSTOPPED(status))
+    {
+      task->stopped = true;
+      if (job)
+        job->SetIsStopped(true);
+      continue;
+    }
+    task->finish = _monotonicMs();
+    task->exit_status = _exitStatus(status);
+    if (job)
+    {
+      jobs.addFinishedJob(job, status, usage);
+      jobs.removeJobById(task->job_id);
+    }
+    smash.GetAffinityReference().release(task->pid);
+  }
+  running.clear();
+}
+
+// keeps up to max_running tasks alive, starting the next one whenever one
+// exits. exits are noticed through one pidfd per task, polled together with
+// the shell's event fd so ctrl-C, ctrl-Z and timeouts are still served.
+// ctrl-C/ctrl-Z reach every running task and no new one is started.
+void ParallelCommand::run(vector<Task> &tasks, int max_running)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  JobsList &jobs = smash.GetJobsListReference();
+  int group_id = jobs.newGroupId();
+  Command *outer = smash.GetCommand();
+  SetForeground(true);
+  smash.SetCommand(this);
+  size_t next = 0;
+  while (next < tasks.size() || !running.empty())
+  {
+    if (!isForeground())
+    {
+      collectStopped();
+      break;
+    }
+    while ((int)running.size() < max_running && next < tasks.size())
+    {
+      Task &task = tasks[next++];
+      shared_ptr<Command> cmd(new ExternalCommand(task.cmd_line.c_str()));
+      // tasks are jobs: they get the background cpus and priorities
+      cmd->SetForeground(false);
+      RedirectionList no_fds;
+      task.pid = cmd->spawn(no_fds, 0);
+      if (task.pid == -1)
+      {
+        continue;
+      }
+      cmd->SetPid(task.pid);
+      task.start = _monotonicMs();
+      task.pid_fd = syscall(SYS_pidfd_open, task.pid, 0);
+      jobs.addJob(cmd, task.pid, false);
+      shared_ptr<JobsList::JobEntry> job = jobs.getJobByPid(task.pid);
+      job->SetGroupId(group_id);
+      task.job_id = job->GetJobID();
+      running.push_back(&task);
+    }
+    if (running.empty())
+      break;
+    vector<struct pollfd> fds;
+    for (auto ir = running.begin(); ir != running.end(); ++ir)
+      fds.push_back({(*ir)->pid_fd, POLLIN, 0});
+    fds.push_back({smash.GetEventFd(), POLLIN, 0});
+    // without pidfds, fall back to waiting for the oldest task
+    bool have_pidfds = running.front()->pid_fd != -1;
+    if (have_pidfds && poll(fds.data(), fds.size(), -1) == -1 && errno != EINTR)
+    {
+      perror("smash error: poll failed");
+      return;
+    }
+    if (fds.back().revents & POLLIN)
+      smash.handleEvents(0);
+    for (size_t i = 0; i < running.size();)
+    {
+      Task *task = running[i];
+      int status;
+      struct rusage usage;
+      int options = (have_pidfds || i > 0) ? WNOHANG : 0;
+      if (wait4(task->pid, &status, options, &usage) != task->pid)
+      {
+        i++;
+        continue;
+      }
+      task->finish = _monotonicMs();
+      task->exit_status = _exitStatus(status);
+      if (task->pid_fd != -1)
+        close(task->pid_fd);
+      shared_ptr<JobsList::JobEntry> job = jobs.getJobById(task->job_id);
+      if (job)
+      {
+        jobs.addFinishedJob(job, status, usage);
+        jobs.removeJobById(task->job_id);
+      }
+      smash.GetAffinityReference().release(task->pid);
+      running.erase(running.begin() + i);
+    }
+  }
+  smash.SetCommand(outer);
+}
+
+/*----- BUILT-IN TABLE -----*/
+
+uint32_t _hashWord(const char *word, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ (unsigned char)word[i]) * 16777619u;
+  }
+  return hash;
+}
+
+BuiltinTable::BuiltinEntry::BuiltinEntry() : name(""), hash(0), factory(NULL), alias(""), is_alias(false) {}
+
+BuiltinTable::BuiltinEntry::BuiltinEntry(string name, uint32_t hash) : name(name), hash(hash), factory(NULL), alias(""), is_alias(false) {}
+
+const string &BuiltinTable::BuiltinEntry::GetName()
+{
+  return name;
+}
+
+uint32_t BuiltinTable::BuiltinEntry::GetHash()
+{
+  return hash;
+}
+
+bool BuiltinTable::BuiltinEntry::isFree()
+{
+  return name.empty();
+}
+
+BuiltinTable::Factory BuiltinTable::BuiltinEntry::GetFactory()
+{
+  return factory;
+}
+
+void BuiltinTable::BuiltinEntry::SetFactory(Factory new_factory)
+{
+  factory = new_factory;
+}
+
+bool BuiltinTable::BuiltinEntry::isAlias()
+{
+  return is_alias;
+}
+
+const string &BuiltinTable::BuiltinEntry::GetAlias()
+{
+  return alias;
+}
+
+void BuiltinTable::BuiltinEntry::SetAlias(string new_alias)
+{
+  alias = new_alias;
+  is_alias = true;
+}
+
+void BuiltinTable::BuiltinEntry::RemoveAlias()
+{
+  alias.clear();
+  is_alias = false;
+}
+
+BuiltinTable::BuiltinTable() : slots(BUILTIN_TABLE_MIN_SLOTS), num_entries(0) {}
+
+// filled by the registrars before main, so it cannot be a SmallShell member
+BuiltinTable &BuiltinTable::getInstance()
+{
+  static BuiltinTable instance;
+  return instance;
+}
+
+BuiltinTable::Registrar::Registrar(const char *name, uint32_t hash, Factory factory)
+{
+  BuiltinTable::getInstance().addBuiltin(name, hash, factory);
+}
+
+// the table is at most half full, so probing always ends on a free slot
+BuiltinTable::BuiltinEntry *BuiltinTable::find(const char *name, size_t length, uint32_t hash)
+{
+  size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask)
+  {
+    BuiltinEntry &entry = slots[i];
+    if (entry.isFree())
+      return NULL;
+    if (entry.GetHash() == hash && entry.GetName().compare(0, string::npos, name, length) == 0)
+      return &entry;
+  }
+}
+
+// the entry for the name, added (without a factory or alias) if missing.
+// names are never removed, so entries only move when the table grows.
+BuiltinTable::BuiltinEntry *BuiltinTable::insert(const char *name, size_t length, uint32_t hash)
+{
+  BuiltinEntry *entry = find(name, length, hash);
+  if (entry)
+    return entry;
+  if ((num_entries + 1) * 2 > slots.size())
+  {
+    vector<BuiltinEntry> old_slots(slots.size() * 2);
+    old_slots.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (auto ir = old_slots.begin(); ir != old_slots.end(); ++ir)
+    {
+      if (ir->isFree())
+        continue;
+      size_t i = ir->GetHash() & mask;
+      while (!slots[i].isFree())
+        i = (i + 1) & mask;
+      slots[i] = std::move(*ir);
+    }
+  }
+  size_t mask = slots.size() - 1;
+  size_t i = hash & mask;
+  while (!slots[i].isFree())
+    i = (i + 1) & mask;
+  slots[i] = BuiltinEntry(string(name, length), hash);
+  num_entries++;
+  return &slots[i];
+}
+
+void BuiltinTable::addBuiltin(const char *name, uint32_t hash, Factory factory)
+{
+  insert(name, strlen(name), hash)->SetFactory(factory);
+}
+
+BuiltinTable::Factory BuiltinTable::replaceBuiltin(const string &name, Factory factory)
+{
+  BuiltinEntry *entry = insert(name.c_str(), name.length(), _hashWord(name.c_str(), name.length()));
+  Factory previous = entry->GetFactory();
+  entry->SetFactory(factory);
+  return previous;
+}
+
+BuiltinTable::BuiltinEntry *BuiltinTable::lookup(const char *name, size_t length)
+{
+  if (length == 0)
+    return NULL;
+  BuiltinEntry *entry = find(name, length, _hashWord(name, length));
+  if (entry && !entry->GetFactory() && !entry->isAlias())
+    return NULL;
+  return entry;
+}
+
+void BuiltinTable::setAlias(const string &name, const string &value)
+{
+  insert(name.c_str(), name.length(), _hashWord(name.c_str(), name.length()))->SetAlias(value);
+}
+
+bool BuiltinTable::removeAlias(const string &name)
+{
+  BuiltinEntry *entry = find(name.c_str(), name.length(), _hashWord(name.c_str(), name.length()));
+  if (!entry || !entry->isAlias())
+    return false;
+  entry->RemoveAlias();
+  return true;
+}
+
+void BuiltinTable::clearAliases()
+{
+  for (auto ir = slots.begin(); ir != slots.end(); ++ir)
+    ir->RemoveAlias();
+}
+
+bool _aliasNameLess(BuiltinTable::BuiltinEntry *a, BuiltinTable::BuiltinEntry *b)
+{
+  return a->GetName() < b->GetName();
+}
+
+// in bash's format (and order), so the output can be read back in
+void BuiltinTable::printAliases()
+{
+  vector<BuiltinEntry *> aliases;
+  for (auto ir = slots.begin(); ir != slots.end(); ++ir)
   {
-    smash.RemoveFinishedJobs();
-    jobs->addJobWithId(smash.GetCommand(), cur_job->GetPid(), cur_job->GetJobID(), true);
-    return;
+    if (ir->isAlias())
+      aliases.push_back(&*ir);
   }
+  std::sort(aliases.begin(), aliases.end(), _aliasNameLess);
+  for (auto ir = aliases.begin(); ir != aliases.end(); ++ir)
+    cout << "alias " << (*ir)->GetName() << "='" << (*ir)->GetAlias() << "'\n";
 }
-/*----- BACKGROUND COMMANDS -----*/
 
-BackgroundCommand::BackgroundCommand(const char *cmd_line, shared_ptr<JobsList> jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+// characters that cannot be part of an alias name
+const std::string ALIAS_NAME_INVALID_CHARS = WHITESPACE + "/$`'\"\\=<>|&;()";
 
-void BackgroundCommand::execute()
+AliasCommand::AliasCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("alias", AliasCommand);
+
+void AliasCommand::execute()
 {
-  char *args[20];
-  int i = _parseCommandLine(GetCmd_line(), args);
-  shared_ptr<JobsList::JobEntry> cur_job;
-  // bring max job && stopped to front
-  if (i == 1)
+  BuiltinTable &table = BuiltinTable::getInstance();
+  if (GetArgs().size() == 1)
   {
-    cur_job = jobs->getLastStoppedJob();
-    if (!cur_job)
+    table.printAliases();
+    return;
+  }
+  // the definition comes from the line itself, the value may contain blanks
+  const char *rest = GetCmd_line() + strspn(GetCmd_line(), WHITESPACE.c_str());
+  rest += strcspn(rest, WHITESPACE.c_str());
+  string definition = _trim(string(rest));
+  size_t equals = definition.find('=');
+  string name = definition.substr(0, equals);
+  if (name.empty() || name.find_first_of(ALIAS_NAME_INVALID_CHARS) != string::npos)
+  {
+    cerr << "smash error: alias: " << name << ": invalid alias name" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  if (equals == string::npos)
+  {
+    BuiltinTable::BuiltinEntry *entry = table.lookup(name.c_str(), name.length());
+    if (!entry || !entry->isAlias())
     {
-      std::cerr << "smash error: bg: there is no stopped jobs to resume" << std::endl;
+      cerr << "smash error: alias: " << name << ": not found" << endl;
+      SmallShell::getInstance().SetLastStatus(1);
       return;
     }
+    cout << "alias " << name << "='" << entry->GetAlias() << "'" << endl;
+    return;
   }
-  // bring forward specific job-id
-  else if (i == 2)
+  string value = definition.substr(equals + 1);
+  if (value.length() >= 2 && (value[0] == '\'' || value[0] == '"') && value.back() == value[0])
   {
-    if (atoi(args[1]) == 0)
+    value = value.substr(1, value.length() - 2);
+  }
+  table.setAlias(name, value);
+}
+
+UnaliasCommand::UnaliasCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("unalias", UnaliasCommand);
+
+void UnaliasCommand::execute()
+{
+  BuiltinTable &table = BuiltinTable::getInstance();
+  CommandArgs &args = GetArgs();
+  if (args.size() == 1)
+  {
+    cerr << "smash error: unalias: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  if (strcmp(args[1], "-a") == 0)
+  {
+    table.clearAliases();
+    return;
+  }
+  for (int i = 1; i < args.size(); i++)
+  {
+    if (!table.removeAlias(args[i]))
     {
-      cerr << "smash error: bg: invalid arguments" << endl;
-      return;
+      cerr << "smash error: unalias: " << args[i] << ": not found" << endl;
+      SmallShell::getInstance().SetLastStatus(1);
     }
-    else
+  }
+}
+
+/*----- STATISTICS -----*/
+
+long long _monotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ShellStats::PhaseStats::PhaseStats() : count(0), total_ns(0), max_ns(0)
+{
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void ShellStats::PhaseStats::record(long long ns)
+{
+  if (ns < 1)
+    ns = 1;
+  count++;
+  total_ns += ns;
+  max_ns = max(max_ns, ns);
+  int bucket = 63 - __builtin_clzll((unsigned long long)ns);
+  buckets[min(bucket, STATS_BUCKETS - 1)]++;
+}
+
+long long ShellStats::PhaseStats::GetCount()
+{
+  return count;
+}
+
+long long ShellStats::PhaseStats::GetTotalNs()
+{
+  return total_ns;
+}
+
+long long ShellStats::PhaseStats::GetMaxNs()
+{
+  return max_ns;
+}
+
+long long ShellStats::PhaseStats::GetBucket(int i)
+{
+  return buckets[i];
+}
+
+long long ShellStats::PhaseStats::percentileNs(double fraction)
+{
+  long long target = (long long)(fraction * count + 0.5);
+  long long seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++)
+  {
+    seen += buckets[i];
+    if (seen >= target && seen > 0)
+      return min(1LL << (i + 1), max_ns);
+  }
+  return max_ns;
+}
+
+// a bucket bound for the histograms: 512ns, 1.0us, 2.1ms...
+string _formatNs(long long ns)
+{
+  std::ostringstream out;
+  out << fixed << setprecision(1);
+  if (ns < 1000)
+    out << ns << "ns";
+  else if (ns < 1000000)
+    out << ns / 1e3 << "us";
+  else if (ns < 1000000000)
+    out << ns / 1e6 << "ms";
+  else
+    out << ns / 1e9 << "s";
+  return out.str();
+}
+
+const char *ShellStats::phaseName(Phase phase)
+{
+  static const char *names[PHASE_MAX] = {"parse", "dispatch", "redirect", "lookup", "spawn", "fork", "execute", "wait", "sweep"};
+  return names[phase];
+}
+
+const char *ShellStats::kindName(Kind kind)
+{
+  static const char *names[KIND_MAX] = {"builtin", "external", "shell"};
+  return names[kind];
+}
+
+void ShellStats::record(Phase phase, Kind kind, long long ns)
+{
+  phases[phase][kind].record(ns);
+}
+
+void ShellStats::reset()
+{
+  for (int phase = 0; phase < PHASE_MAX; phase++)
+  {
+    for (int kind = 0; kind < KIND_MAX; kind++)
+      phases[phase][kind] = PhaseStats();
+  }
+}
+
+// one row per phase and kind that has calls; with histograms, the non empty
+// buckets of each row follow it
+void ShellStats::print(bool histograms)
+{
+  bool any = false;
+  cout << left << setw(10) << "phase" << setw(10) << "kind" << right << setw(10) << "count" << setw(12) << "total_ms";
+  cout << setw(10) << "mean_us" << setw(10) << "p50_us" << setw(10) << "p99_us" << setw(10) << "max_us" << '\n';
+  cout << fixed << setprecision(1);
+  for (int phase = 0; phase < PHASE_MAX; phase++)
+  {
+    for (int kind = 0; kind < KIND_MAX; kind++)
     {
-      cur_job = jobs->getJobById(atoi(args[1]));
-      if (!cur_job)
-      {
-        std::cerr << "smash error: bg: job-id " << args[1] << " does not exist" << std::endl;
-        return;
-      }
-      if (cur_job->isStopped() == false)
+      PhaseStats &stats = phases[phase][kind];
+      if (stats.GetCount() == 0)
+        continue;
+      any = true;
+      cout << left << setw(10) << phaseName((Phase)phase) << setw(10) << kindName((Kind)kind) << right << setw(10) << stats.GetCount();
+      cout << setw(12) << stats.GetTotalNs() / 1e6 << setw(10) << stats.GetTotalNs() / 1e3 / stats.GetCount();
+      cout << setw(10) << stats.percentileNs(0.5) / 1e3 << setw(10) << stats.percentileNs(0.99) / 1e3 << setw(10) << stats.GetMaxNs() / 1e3 << '\n';
+      if (!histograms)
+        continue;
+      for (int i = 0; i < STATS_BUCKETS; i++)
       {
-        std::cerr << "smash error: bg: job-id " << args[1] << " is already running in the background" << std::endl;
-        return;
+        if (stats.GetBucket(i) == 0)
+          continue;
+        int width = (int)(40 * stats.GetBucket(i) / stats.GetCount());
+        cout << "    >= " << setw(12) << _formatNs(1LL << i) << setw(10) << stats.GetBucket(i) << " " << string(max(width, 1), '#') << '\n';
       }
     }
   }
-  else
+  cout << defaultfloat;
+  if (!any)
   {
-    std::cerr << "smash error: bg: invalid arguments" << std::endl;
-    return;
+    cout << "smash: stats: nothing recorded yet\n";
   }
-  // set stopped and execute in background
-  cout << cur_job->GetCommandLine() << " : " << cur_job->GetPid() << " " << endl;
-  DO_SYS(kill(cur_job->GetPid(), SIGCONT), "kill");
-  cur_job->SetIsStopped(false);
 }
 
-/*----- EXTERNAL COMMANDS -----*/
+void ShellStats::printJson(std::ostream &out)
+{
+  out << "{\n  \"phases\": [";
+  bool first = true;
+  for (int phase = 0; phase < PHASE_MAX; phase++)
+  {
+    for (int kind = 0; kind < KIND_MAX; kind++)
+    {
+      PhaseStats &stats = phases[phase][kind];
+      if (stats.GetCount() == 0)
+        continue;
+      out << (first ? "\n" : ",\n");
+      first = false;
+      out << "    {\"phase\": \"" << phaseName((Phase)phase) << "\", \"kind\": \"" << kindName((Kind)kind) << "\"";
+      out << ", \"count\": " << stats.GetCount() << ", \"total_ns\": " << stats.GetTotalNs() << ", \"max_ns\": " << stats.GetMaxNs();
+      out << ", \"p50_ns\": " << stats.percentileNs(0.5) << ", \"p99_ns\": " << stats.percentileNs(0.99);
+      // [lower bound in ns, count] of the non empty buckets
+      out << ", \"buckets\": [";
+      bool first_bucket = true;
+      for (int i = 0; i < STATS_BUCKETS; i++)
+      {
+        if (stats.GetBucket(i) == 0)
+          continue;
+        out << (first_bucket ? "" : ", ") << "[" << (1LL << i) << ", " << stats.GetBucket(i) << "]";
+        first_bucket = false;
+      }
+      out << "]}";
+    }
+  }
+  out << "\n  ]\n}\n";
+}
 
-ExternalCommand::ExternalCommand(const char *cmd_line) : Command(cmd_line), pid(-1) {}
+PhaseTimer::PhaseTimer(ShellStats::Phase phase, ShellStats::Kind kind) : phase(phase), kind(kind), start(_monotonicNs()), stopped(false) {}
 
-void ExternalCommand::execute()
+PhaseTimer::~PhaseTimer()
 {
-  // SmallShell& smash = SmallShell::getInstance();
-  char *cmd_line = strdup(const_cast<char *>(GetCmd_line()));
-  _removeBackgroundSign(cmd_line);
-  char *bin_bash = strdup(const_cast<char *>("/bin/bash"));
-  char *c = strdup(const_cast<char *>("-c"));
-  char *args[4] = {bin_bash, c, cmd_line, NULL};
-  // DO_SYS(execv(args[0], args), "execv");
-  DO_SYS(execvp(args[0], args), "execvp");
-  exit(0);
+  stop();
 }
 
-void ExternalCommand::SetPid(pid_t new_pid)
+void PhaseTimer::stop()
 {
-  pid = new_pid;
+  if (stopped)
+    return;
+  stopped = true;
+  SmallShell::getInstance().recordPhase(phase, kind, start, _monotonicNs());
 }
 
-pid_t ExternalCommand::GetPid()
+ShellStats::Kind _commandKind(Command *cmd)
 {
-  return pid;
+  return _spawnsChild(cmd) ? ShellStats::KIND_EXTERNAL : ShellStats::KIND_BUILTIN;
 }
 
-/*----- JOBS LIST -----*/
+StatsCommand::StatsCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("stats", StatsCommand);
+
+void StatsCommand::execute()
+{
+  ShellStats &stats = SmallShell::getInstance().GetStatsReference();
+  CommandArgs &args = GetArgs();
+  if (args.size() > 2)
+  {
+    cerr << "smash error: stats: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+    return;
+  }
+  if (!args[1])
+  {
+    stats.print(false);
+  }
+  else if (strcmp(args[1], "-v") == 0)
+  {
+    stats.print(true);
+  }
+  else if (strcmp(args[1], "-j") == 0)
+  {
+    stats.printJson(cout);
+  }
+  else if (strcmp(args[1], "-r") == 0)
+  {
+    stats.reset();
+  }
+  else
+  {
+    cerr << "smash error: stats: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
+  }
+}
 
-JobsList::JobEntry::JobEntry() : job_id(-1), pid(-1), cmd(NULL), is_stopped(false), time(0){};
+/*----- TRACING -----*/
 
-JobsList::JobEntry::JobEntry(int job_id, pid_t pid, Command *cmd, bool is_stopped, time_t time) : job_id(job_id), pid(pid), cmd(cmd), is_stopped(is_stopped), time(time){};
+void _appendJsonString(string &out, const char *str)
+{
+  out += '"';
+  for (; *str; str++)
+  {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\')
+    {
+      out += '\\';
+      out += c;
+    }
+    else if (c < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    }
+    else
+      out += c;
+  }
+  out += '"';
+}
 
-bool JobsList::JobEntry::isStopped()
+// trace timestamps are microseconds, kept to the ns
+void _appendMicros(string &out, long long ns)
 {
-  return is_stopped;
+  char micros[32];
+  snprintf(micros, sizeof(micros), "%lld.%03lld", ns / 1000, ns % 1000);
+  out += micros;
 }
 
-void JobsList::JobEntry::SetIsStopped(bool isStopped)
+TraceLog::TraceLog() : fd(-1), owner(0) {}
+
+TraceLog::~TraceLog()
 {
-  is_stopped = isStopped;
+  close();
 }
 
-const int &JobsList::JobEntry::GetJobID()
+bool TraceLog::open(const string &file)
 {
-  return job_id;
+  close();
+  int new_fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (new_fd == -1)
+  {
+    perror("smash error: open failed");
+    return false;
+  }
+  fd = new_fd;
+  owner = getpid();
+  this->file = file;
+  // names for the viewer's rows
+  buffer = "[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " + to_string(owner) + ", \"args\": {\"name\": \"smash\"}}";
+  buffer += ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " + to_string(owner) + ", \"tid\": " + to_string(owner) + ", \"args\": {\"name\": \"shell\"}}";
+  flush();
+  return true;
 }
 
-pid_t JobsList::JobEntry::GetPid()
+void TraceLog::close()
 {
-  return pid;
+  if (fd == -1)
+    return;
+  if (getpid() == owner)
+  {
+    buffer += "\n]\n";
+    flush();
+  }
+  if (fd != -1)
+    ::close(fd);
+  fd = -1;
+  buffer.clear();
 }
 
-const char *JobsList::JobEntry::GetCommandLine()
+// a forked child drops what it recorded, only the shell writes the file
+void TraceLog::flush()
 {
-  return cmd->GetCmd_line();
+  if (fd == -1 || getpid() != owner)
+  {
+    buffer.clear();
+    return;
+  }
+  size_t written = 0;
+  while (written < buffer.size())
+  {
+    ssize_t count = write(fd, buffer.data() + written, buffer.size() - written);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count == -1)
+    {
+      perror("smash error: write failed");
+      ::close(fd);
+      fd = -1;
+      break;
+    }
+    written += count;
+  }
+  buffer.clear();
 }
 
-time_t JobsList::JobEntry::GetTime()
+const string &TraceLog::GetFile()
 {
-  return time;
+  return file;
 }
 
-Command *JobsList::JobEntry::GetCommand()
+// the common head of an event, left open for its own fields
+void TraceLog::event(const char *name, const char *category, char type, long long ts_ns, pid_t tid)
 {
-  return cmd;
+  if (buffer.size() >= TRACE_BUFFER_SIZE)
+    flush();
+  buffer += ",\n{\"name\": ";
+  _appendJsonString(buffer, name);
+  buffer += ", \"cat\": \"";
+  buffer += category;
+  buffer += "\", \"ph\": \"";
+  buffer += type;
+  buffer += "\", \"ts\": ";
+  _appendMicros(buffer, ts_ns);
+  buffer += ", \"pid\": " + to_string(owner) + ", \"tid\": " + to_string(tid);
 }
 
-JobsList::JobsList() : max_job_id(0)
+void TraceLog::endEvent(const char *detail)
 {
-  std::vector<std::shared_ptr<JobEntry>> jobs_list;
+  if (detail)
+  {
+    buffer += ", \"args\": {\"cmd\": ";
+    _appendJsonString(buffer, detail);
+    buffer += "}";
+  }
+  buffer += "}";
 }
 
-void JobsList::addJob(Command *cmd, pid_t pid, bool isStopped)
+void TraceLog::span(const char *name, const char *category, long long start_ns, long long end_ns, pid_t tid, const char *detail)
 {
-  Command *new_cmd(cmd);
-  shared_ptr<JobEntry> new_job(new JobEntry(++max_job_id, pid, new_cmd, isStopped, time(NULL)));
-  jobs_list.push_back(new_job);
-  // printJobsList();
+  if (fd == -1)
+    return;
+  event(name, category, 'X', start_ns, tid);
+  buffer += ", \"dur\": ";
+  _appendMicros(buffer, end_ns - start_ns);
+  endEvent(detail);
 }
 
-void JobsList::addJobWithId(Command *cmd, pid_t pid, int job_id, bool isStopped)
+void TraceLog::instant(const char *name, const char *category, pid_t tid, const char *detail)
 {
-  Command *new_cmd(cmd);
-  shared_ptr<JobEntry> new_job(new JobEntry(job_id, pid, new_cmd, isStopped, time(NULL)));
-  if (max_job_id < job_id)
+  if (fd == -1)
+    return;
+  event(name, category, 'i', _monotonicNs(), tid);
+  buffer += ", \"s\": \"t\"";
+  endEvent(detail);
+}
+
+TraceCommand::TraceCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("trace", TraceCommand);
+
+void TraceCommand::execute()
+{
+  TraceLog &trace = SmallShell::getInstance().GetTraceLogReference();
+  CommandArgs &args = GetArgs();
+  if (!args[1])
   {
-    max_job_id = job_id;
-    jobs_list.push_back(new_job);
+    if (trace.isOn())
+      cout << "smash: trace: writing to " << trace.GetFile() << '\n';
+    else
+      cout << "smash: trace: off\n";
+  }
+  else if (strcmp(args[1], "on") == 0 && args.size() == 3)
+  {
+    if (!trace.open(args[2]))
+      SmallShell::getInstance().SetLastStatus(1);
+  }
+  else if (strcmp(args[1], "off") == 0 && args.size() == 2)
+  {
+    trace.close();
   }
   else
   {
-    for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
-    {
-      if ((*ir)->GetJobID() > new_job->GetJobID())
-      {
-        jobs_list.insert(ir, new_job);
-        break;
-      }
-    }
+    cerr << "smash error: trace: invalid arguments" << endl;
+    SmallShell::getInstance().SetLastStatus(1);
   }
-  // printJobsList();
 }
 
-void JobsList::printJobsList()
+/*----- PLUGINS -----*/
+
+PluginList::PluginEntry::PluginEntry() : file(""), handle(NULL), builtin(NULL), previous(NULL) {}
+
+PluginList::PluginEntry::PluginEntry(string file, void *handle, const struct smash_builtin *builtin, BuiltinTable::Factory previous) : file(file), handle(handle), builtin(builtin), previous(previous) {}
+
+const string &PluginList::PluginEntry::GetFile()
+{
+  return file;
+}
+
+void *PluginList::PluginEntry::GetHandle()
+{
+  return handle;
+}
+
+const struct smash_builtin *PluginList::PluginEntry::GetBuiltin()
+{
+  return builtin;
+}
+
+BuiltinTable::Factory PluginList::PluginEntry::GetPrevious()
+{
+  return previous;
+}
+
+PluginList::~PluginList()
+{
+  for (auto ir = plugins.begin(); ir != plugins.end(); ++ir)
+    dlclose(ir->second.GetHandle());
+}
+
+// a PluginCommand for the plugin named by the first word of the line
+Command *_createPluginCommand(const char *cmd_line)
+{
+  SmallShell &smash = SmallShell::getInstance();
+  const char *word = cmd_line + strspn(cmd_line, WHITESPACE.c_str());
+  string name(word, strcspn(word, WORD_DELIMITERS.c_str()));
+  return smash.GetCommandArena().create<PluginCommand>(cmd_line, smash.GetPluginListReference().find(name));
+}
+
+// loads the smash_builtin_<name> symbol of the shared object and registers
+// it as the built-in name, over any built-in of that name
+bool PluginList::load(const string &file, const string &name)
 {
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  if (plugins.count(name))
   {
-    cout << "[" << (*ir)->GetJobID() << "] " << (*ir)->GetCommandLine() << " : " << (*ir)->GetPid() << " " << difftime(time(NULL), (*ir)->GetTime()) << " secs";
-    if ((*ir)->isStopped())
-    {
-      cout << " (stopped)";
-    }
-    cout << endl;
+    unload(name);
+  }
+  void *handle = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+  {
+    cerr << "smash error: enable: cannot open shared object " << file << ": " << dlerror() << endl;
+    return false;
+  }
+  const struct smash_builtin *builtin = (const struct smash_builtin *)dlsym(handle, ("smash_builtin_" + name).c_str());
+  if (!builtin)
+  {
+    cerr << "smash error: enable: " << name << ": not found in " << file << endl;
+    dlclose(handle);
+    return false;
+  }
+  if (builtin->abi_version != SMASH_PLUGIN_ABI_VERSION || !builtin->run)
+  {
+    cerr << "smash error: enable: " << name << ": unsupported plugin version " << builtin->abi_version << endl;
+    dlclose(handle);
+    return false;
   }
+  BuiltinTable::Factory previous = BuiltinTable::getInstance().replaceBuiltin(name, &_createPluginCommand);
+  plugins[name] = PluginEntry(file, handle, builtin, previous);
+  return true;
 }
 
-void JobsList::clearJobsList(){
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+// puts back the built-in the plugin replaced (if any)
+bool PluginList::unload(const string &name)
+{
+  auto found = plugins.find(name);
+  if (found == plugins.end())
   {
-    delete (*ir)->GetCommand();
+    return false;
   }
-  jobs_list.clear();
+  BuiltinTable::getInstance().replaceBuiltin(name, found->second.GetPrevious());
+  dlclose(found->second.GetHandle());
+  plugins.erase(found);
+  return true;
 }
 
-void JobsList::killAllJobs()
+const struct smash_builtin *PluginList::find(const string &name)
+{
+  auto found = plugins.find(name);
+  return (found == plugins.end()) ? NULL : found->second.GetBuiltin();
+}
+
+void PluginList::printPlugins()
+{
+  vector<string> names;
+  for (auto ir = plugins.begin(); ir != plugins.end(); ++ir)
+    names.push_back(ir->first);
+  std::sort(names.begin(), names.end());
+  for (auto ir = names.begin(); ir != names.end(); ++ir)
+    cout << "enable -f " << plugins[*ir].GetFile() << " " << *ir << "\n";
+}
+
+PluginCommand::PluginCommand(const char *cmd_line, const struct smash_builtin *builtin) : BuiltInCommand(cmd_line), builtin(builtin) {}
+
+void PluginCommand::execute()
+{
+  CommandArgs &args = GetArgs();
+  // the plugin writes to the fds itself, after whatever went through cout
+  cout.flush();
+  int status = builtin->run(args.size(), args.data());
+  fflush(stdout);
+  fflush(stderr);
+  // stdin may be a pipe that is about to be restored: drop what stdio read ahead
+  __fpurge(stdin);
+  clearerr(stdin);
+  clearerr(stdout);
+  SmallShell::getInstance().SetLastStatus(status);
+}
+
+EnableCommand::EnableCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+REGISTER_BUILTIN("enable", EnableCommand);
+
+void EnableCommand::execute()
 {
-  int num_of_jobs = 0;
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  PluginList &plugins = SmallShell::getInstance().GetPluginListReference();
+  CommandArgs &args = GetArgs();
+  int num_args = args.size();
+  if (num_args == 1)
   {
-    num_of_jobs++;
+    plugins.printPlugins();
+    return;
   }
-  cout << "smash: sending SIGKILL signal to " << num_of_jobs << " jobs:" << endl;
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  if (strcmp(args[1], "-f") == 0 && num_args >= 4)
   {
-    DO_SYS(kill((*ir)->GetPid(), SIGKILL), "kill");
-    cout << (*ir)->GetPid() << ": " << (*ir)->GetCommandLine() << endl;
-    delete (*ir)->GetCommand();
+    for (int i = 3; i < num_args; i++)
+    {
+      if (!plugins.load(args[2], args[i]))
+        SmallShell::getInstance().SetLastStatus(1);
+    }
+    return;
   }
-  jobs_list.clear();
-}
-
-void JobsList::removeFinishedJobs()
-{
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  if (strcmp(args[1], "-d") == 0 && num_args >= 3)
   {
-    if (waitpid((*ir)->GetPid(), NULL, WNOHANG) > 0)
+    for (int i = 2; i < num_args; i++)
     {
-      int cur_job_id = (*ir)->GetJobID();
-      delete (*ir)->GetCommand();
-      jobs_list.erase(ir);
-      ir--;
-      if (cur_job_id == max_job_id)
+      if (!plugins.unload(args[i]))
       {
-        if (!jobs_list.empty())
-        {
-          max_job_id = ((*ir)->GetJobID());
-        }
-        else
-          max_job_id = 0;
+        cerr << "smash error: enable: " << args[i] << ": not a dynamically loaded builtin" << endl;
+        SmallShell::getInstance().SetLastStatus(1);
       }
     }
+    return;
   }
+  cerr << "smash error: enable: invalid arguments" << endl;
+  SmallShell::getInstance().SetLastStatus(1);
 }
 
-std::shared_ptr<JobsList::JobEntry> JobsList::getLastJob()
-{
-  if (jobs_list.empty())
-    return nullptr;
-  return jobs_list.back();
-}
+/*----- EVENT LOOP -----*/
 
-std::shared_ptr<JobsList::JobEntry> JobsList::getLastStoppedJob()
+// the shell handles SIGINT, SIGTSTP, SIGCHLD and timeouts synchronously:
+// the signals stay blocked and are read from a signalfd, timeouts come from
+// the TimesList timerfd, and both are multiplexed with the input on epoll.
+bool SmallShell::setupEvents()
 {
-  if (jobs_list.empty())
-    return nullptr;
-  for (auto ir = jobs_list.rbegin(); ir != jobs_list.rend(); ++ir)
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTSTP);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
   {
-    if ((*ir)->isStopped())
-    {
-      return *ir;
-    }
+    perror("smash error: sigprocmask failed");
+    return false;
   }
-  return nullptr;
-}
-
-std::shared_ptr<JobsList::JobEntry> JobsList::getJobById(int jobId)
-{
-  if(jobId <= 0) {
-    return nullptr;
+  signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  // built-in pipeline stages write to pipes from the shell itself, a reader
+  // that quits early must give EPIPE rather than kill the shell
+  sigset_t pipe_mask;
+  sigemptyset(&pipe_mask);
+  sigaddset(&pipe_mask, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipe_mask, NULL);
+  if (signal_fd == -1)
+  {
+    perror("smash error: signalfd failed");
+    return false;
   }
-  std::shared_ptr<JobEntry> job_to_remove;
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
   {
-    if ((*ir)->GetJobID() == jobId)
-    {
-      std::shared_ptr<JobEntry> job_to_remove = *ir;
-      // cout << "get job by id returned: job id " << (*ir)->GetJobID() << " pid: " << (*ir)->GetPid() << endl;
-      return job_to_remove;
-    }
+    perror("smash error: epoll_create failed");
+    return false;
   }
-  return nullptr;
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = signal_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1)
+  {
+    perror("smash error: epoll_ctl failed");
+    return false;
+  }
+  event.data.fd = times_list.GetTimerFd();
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event) == -1)
+  {
+    perror("smash error: epoll_ctl failed");
+    return false;
+  }
+  return true;
 }
 
-std::shared_ptr<JobsList::JobEntry> JobsList::getJobByPid(pid_t pid)
+void SmallShell::dispatchSignals()
 {
-  if(pid <= 0) {
-    return nullptr;
-  }
-  std::shared_ptr<JobEntry> job_to_remove;
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  struct signalfd_siginfo info;
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
   {
-    if ((*ir)->GetPid() == pid)
+    switch (info.ssi_signo)
     {
-      std::shared_ptr<JobEntry> job_to_remove = *ir;
-      // cout << "get job by id returned: job id " << (*ir)->GetJobID() << " pid: " << (*ir)->GetPid() << endl;
-      return job_to_remove;
+    case SIGINT:
+      ctrlCHandler(SIGINT);
+      break;
+    case SIGTSTP:
+      ctrlZHandler(SIGTSTP);
+      break;
+    case SIGCHLD:
+      childHandler(SIGCHLD);
+      break;
     }
   }
-  return nullptr;
 }
 
-void JobsList::removeJobById(int jobId)
+// waits up to timeout_ms (-1 forever) and handles whatever is ready.
+// returns true if the input fd became readable.
+bool SmallShell::handleEvents(int timeout_ms)
 {
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
+  struct epoll_event events[3];
+  int num_events = epoll_wait(epoll_fd, events, 3, timeout_ms);
+  bool input_ready = false;
+  for (int i = 0; i < num_events; i++)
   {
-    if ((*ir)->GetJobID() == jobId)
+    int fd = events[i].data.fd;
+    if (fd == signal_fd)
     {
-      int curr_max = (*ir)->GetJobID();
-      jobs_list.erase(ir);
-      if (jobs_list.empty())
-      {
-        max_job_id = 0;
-      }
-      else if (curr_max == max_job_id)
-      {
-        max_job_id = findMaxJobId();
-      }
-      return;
+      dispatchSignals();
+    }
+    else if (fd == times_list.GetTimerFd())
+    {
+      uint64_t expirations;
+      if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        alarmHandler(SIGALRM);
+    }
+    else
+    {
+      input_ready = true;
     }
   }
+  return input_ready;
 }
 
-int JobsList::findMaxJobId()
+int SmallShell::GetEventFd()
 {
-  int max = 0;
-  for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir)
-  {
-    if ((*ir)->GetJobID() > max)
-      max = (*ir)->GetJobID();
-  }
-  return max;
+  return epoll_fd;
 }
 
-JobsList::~JobsList()
+// serves events until fd has input. fds epoll cannot watch (regular files)
+// are always ready, pending events are still handled first.
+void SmallShell::waitForInput(int fd)
 {
-  // for (auto ir = jobs_list.begin(); ir != jobs_list.end(); ++ir){
-  //   *ir = nullptr;
-  // }
+  if (epoll_fd == -1)
+  {
+    return;
+  }
+  // one-shot, so pending input does not wake up the waits for children
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.fd = fd;
+  int op = (fd == input_fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(epoll_fd, op, fd, &event) == -1)
+  {
+    handleEvents(0);
+    return;
+  }
+  input_fd = fd;
+  while (!handleEvents(-1));
 }
 
-JobsList::JobEntry::~JobEntry(){
-  // delete cmd;
+// like waitpid, but ctrl-C/ctrl-Z, timeouts and other children are served
+// while the child runs
+pid_t SmallShell::waitForChild(pid_t pid, int *status, int options, struct rusage *usage)
+{
+  // whatever was printed so far has to be visible while the child runs
+  cout.flush();
+  PhaseTimer wait_timer(ShellStats::PHASE_WAIT, ShellStats::KIND_EXTERNAL);
+  if (epoll_fd == -1)
+  {
+    return wait4(pid, status, options, usage);
+  }
+  while (true)
+  {
+    pid_t res = wait4(pid, status, options | WNOHANG, usage);
+    if (res != 0)
+    {
+      return res;
+    }
+    handleEvents(-1);
+  }
 }
 
-/*----- TIMES LIST -----*/
-
-TimesList::TimeEntry::TimeEntry() : pid(-1), cmd(NULL), init_time(0), finish_time(0) {};
-
-TimesList::TimeEntry::TimeEntry(pid_t pid, Command* cmd, time_t init_time, time_t finish_time) : pid(pid), cmd(cmd), init_time(init_time), finish_time(finish_time) {};
-
+/*----- SMASH IMPLEMENTATION -----*/
 
-pid_t TimesList::TimeEntry::GetPid()
+SmallShell::SmallShell() : run(true), prompt("smash> "), prev_pwd(""), jobs_list(), times_list(), output_buffer(1), command_arena(), current_cmd(nullptr), shell_pid(getpid()), last_status(0), epoll_fd(-1), signal_fd(-1), input_fd(-1)
 {
-  return pid;
+  output_buffer.install(cout);
+  _spawn_sets_policy = _probeSpawnSetsPolicy();
 }
 
-Command *TimesList::TimeEntry::GetCommand() 
+SmallShell::~SmallShell()
 {
-  return cmd;
+  // delete current_cmd;
 }
 
-const char *TimesList::TimeEntry::GetCommandLine()
+Command *SmallShell::GetCommand()
 {
-  return cmd->GetCmd_line();
+  return current_cmd;
 }
 
-time_t TimesList::TimeEntry::GetDuration()
+void SmallShell::SetCommand(Command *cmd_new)
 {
-  return finish_time - init_time;
+  current_cmd = cmd_new;
 }
 
-time_t TimesList::TimeEntry::GetFinishTime()
+JobsList& SmallShell::GetJobsListReference()
 {
-  return finish_time;
+  return jobs_list;
 }
 
-TimesList::TimesList()
+LaunchPriority& SmallShell::GetBackgroundPriorityReference()
 {
-  std::vector<std::shared_ptr<TimeEntry>> times_list;
+  return background_priority;
 }
 
-void TimesList::addToTimesList(Command* cmd, pid_t pid, time_t duration)
+AffinityList& SmallShell::GetAffinityReference()
 {
-  Command *new_cmd(cmd);
-  time_t init_time = time(NULL);
-  shared_ptr<TimeEntry> new_time(new TimeEntry(pid, new_cmd, init_time, init_time+duration));
-  if (times_list.empty()){
-    times_list.push_back(new_time); 
-    //printTimesList();
-    return;
-  }
-  for (auto ir = times_list.begin(); ir != times_list.end(); ++ir) {
-    if((*ir)->GetFinishTime() > init_time + duration) {
-      times_list.insert(ir, new_time);
-      return;
-    }
-  }
-  times_list.push_back(new_time); 
-  //printTimesList();
+  return affinity;
 }
 
-
-void TimesList::printTimesList()
+CgroupList& SmallShell::GetCgroupListReference()
 {
-  // cout << "printing times list:" << endl;
-  // for (auto ir = times_list.begin(); ir != times_list.end(); ++ir)
-  // {
-  //   cout << " - " << "Finish Time: " << (*ir)->GetFinishTime() << " Duration: "<< (*ir)->GetDuration() << ", Pid: " << (*ir)->GetPid() << ", " << (*ir)->GetCommandLine() << endl;
-  // }
+  return cgroups;
 }
 
-void TimesList::killFinishedAlarms()
+TimesList& SmallShell::GetTimesListReference()
 {
-  time_t curr_time = time(NULL);
-  if (times_list.empty()){
-    return;
-  }
-  if (times_list.front()->GetFinishTime() > curr_time){
-    return;
-  }
-  SmallShell &smash = SmallShell::getInstance();
-  smash.RemoveFinishedJobs();
-  JobsList jobs_list = smash.GetJobsListReference();
-  if (jobs_list.getJobByPid(times_list.front()->GetPid()) || kill(times_list.front()->GetPid(), 0) == 0) { //the process is still alive
-    cout<< "smash: " << times_list.front()->GetCommandLine() << " timed out!" <<endl;
-    DO_SYS(kill(times_list.front()->GetPid(), SIGKILL), "kill");
-  }
-  time_t new_alarm_time = difftime(times_list.front()->GetFinishTime(), curr_time);
-  while (new_alarm_time <= 0) {
-    times_list.erase(times_list.begin());
-    if (times_list.empty()){
-      return;
-    }
-    new_alarm_time = difftime(times_list.front()->GetFinishTime(), curr_time);
-  }
-  alarm(new_alarm_time);
-}
-
-time_t TimesList::GetClosestAlarm() {
-  if (times_list.empty()){
-    return 0;
-  }
-  return times_list.front()->GetDuration();
+  return times_list;
 }
 
-
-/*----- SMASH IMPLEMENTATION -----*/
-
-SmallShell::SmallShell() : run(true), prompt("smash> "), prev_pwd(""), jobs_list(), times_list(), current_cmd(nullptr), shell_pid(getpid()) {}
-
-SmallShell::~SmallShell()
+PathCache& SmallShell::GetPathCacheReference()
 {
-  // delete current_cmd;
+  return path_cache;
 }
 
-Command *SmallShell::GetCommand()
+PluginList& SmallShell::GetPluginListReference()
 {
-  return current_cmd;
+  return plugins;
 }
 
-void SmallShell::SetCommand(Command *cmd_new)
+ShellStats& SmallShell::GetStatsReference()
 {
-  current_cmd = cmd_new;
+  return stats;
 }
 
-shared_ptr<JobsList> SmallShell::GetJobsList()
+TraceLog& SmallShell::GetTraceLogReference()
 {
-  shared_ptr<JobsList> jobs_list_ptr(&jobs_list);
-  return jobs_list_ptr;
+  return trace;
 }
 
-JobsList& SmallShell::GetJobsListReference()
+void SmallShell::recordPhase(ShellStats::Phase phase, ShellStats::Kind kind, long long start_ns, long long end_ns)
 {
-  return jobs_list;
+  stats.record(phase, kind, end_ns - start_ns);
+  if (trace.isOn())
+    trace.span(ShellStats::phaseName(phase), ShellStats::kindName(kind), start_ns, end_ns, shell_pid);
 }
 
-TimesList& SmallShell::GetTimesListReference()
+CommandArena& SmallShell::GetCommandArena()
 {
-  return times_list;
+  return command_arena;
 }
 
-std::shared_ptr<TimesList> SmallShell::GetTimesList() {
-  shared_ptr<TimesList> times_list_ptr(&times_list);
-  return times_list_ptr;
+// an owned copy of an arena command that has to outlive its line (a job or a
+// timed command). only commands that _spawnsChild, and stopped pipelines,
+// ever get here.
+shared_ptr<Command> SmallShell::promoteCommand(Command *cmd)
+{
+  Command *owned;
+  if (typeid(*cmd) == typeid(TimeoutCommand))
+  {
+    owned = new TimeoutCommand(cmd->GetCmd_line());
+  }
+  else if (typeid(*cmd) == typeid(LimitCommand))
+  {
+    owned = new LimitCommand(cmd->GetCmd_line());
+  }
+  else if (typeid(*cmd) == typeid(PinCommand))
+  {
+    owned = new PinCommand(cmd->GetCmd_line());
+  }
+  else if (typeid(*cmd) == typeid(PriorityCommand))
+  {
+    owned = new PriorityCommand(cmd->GetCmd_line());
+  }
+  else if (typeid(*cmd) == typeid(PipeCommand))
+  {
+    PipeCommand *pipeline = new PipeCommand(cmd->GetCmd_line());
+    pipeline->GetStagePids() = ((PipeCommand *)cmd)->GetStagePids();
+    owned = pipeline;
+  }
+  else
+  {
+    owned = new ExternalCommand(cmd->GetCmd_line());
+  }
+  owned->SetPid(cmd->GetPid());
+  owned->SetForeground(cmd->isForeground());
+  return shared_ptr<Command>(owned);
 }
 
 
@@ -912,6 +4514,16 @@ pid_t SmallShell::GetShellPid(){
   return shell_pid;
 }
 
+int SmallShell::GetLastStatus()
+{
+  return last_status;
+}
+
+void SmallShell::SetLastStatus(int status)
+{
+  last_status = status;
+}
+
 std::string &SmallShell::GetPrompt()
 {
   return prompt;
@@ -933,242 +4545,424 @@ void SmallShell::SetPrev_Pwd(std::string new_prev_pwd)
 }
 
 /*
-* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
+* Creates and returns a pointer to Command class which matches the given command line (cmd_line).
+* The command lives in the command arena until the line has run.
 */
 Command *SmallShell::CreateCommand(const char *cmd_line)
 {
-  string cmd_s = _trim(string(cmd_line));
-  string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n>|&"));
-  if (firstWord.compare("chprompt") == 0)
-  {
-    return new ChPromptCommand(cmd_line, prompt);
-  }
-  else if (firstWord.compare("showpid") == 0)
-  {
-    return new ShowPidCommand(cmd_line);
-  }
-  else if (firstWord.compare("pwd") == 0)
-  {
-    return new PwdCommand(cmd_line);
-  }
-  else if (firstWord.compare("cd") == 0)
-  {
-    return new CdCommand(cmd_line);
-  }
-  else if (firstWord.compare("fg") == 0)
+  const char *word = cmd_line + strspn(cmd_line, WHITESPACE.c_str());
+  size_t length = strcspn(word, WORD_DELIMITERS.c_str());
+  BuiltinTable::BuiltinEntry *entry = BuiltinTable::getInstance().lookup(word, length);
+  if (entry && entry->GetFactory())
   {
-    SmallShell &smash = SmallShell::getInstance();
-    return new ForegroundCommand(cmd_line, smash.GetJobsList());
+    return entry->GetFactory()(cmd_line);
   }
-  else if (firstWord.compare("bg") == 0)
+  return command_arena.create<ExternalCommand>(cmd_line);
+}
+
+// replaces the first word of the line by its alias, again while the result
+// starts with another alias. like bash, a name is expanded once at most, so
+// alias ls='ls -l' works. returns cmd_line itself if there is no alias.
+const char *SmallShell::expandAliases(const char *cmd_line)
+{
+  BuiltinTable &table = BuiltinTable::getInstance();
+  vector<BuiltinTable::BuiltinEntry *> expanded;
+  for (int i = 0; i < ALIAS_EXPANSION_MAX; i++)
   {
-    SmallShell &smash = SmallShell::getInstance();
-    return new BackgroundCommand(cmd_line, smash.GetJobsList());
+    const char *word = cmd_line + strspn(cmd_line, WHITESPACE.c_str());
+    size_t length = strcspn(word, WORD_DELIMITERS.c_str());
+    BuiltinTable::BuiltinEntry *entry = table.lookup(word, length);
+    if (!entry || !entry->isAlias() || std::find(expanded.begin(), expanded.end(), entry) != expanded.end())
+    {
+      break;
+    }
+    expanded.push_back(entry);
+    string line = entry->GetAlias() + (word + length);
+    cmd_line = command_arena.copyString(line.c_str());
   }
-  else if (firstWord.compare("jobs") == 0)
+  return cmd_line;
+}
+
+// launches one pipeline stage reading from in_fd (if not 0) and writing to
+// out_fd on out_target (1, or 2 for |&). the pipe fds are close-on-exec, so
+// spawned stages only need the dup2s; forked ones close pipe_fds by hand.
+// pgid 0 makes the stage a group leader.
+pid_t SmallShell::launchPipeStage(Command *cmd, RedirectionList &redirections, int in_fd, int out_fd, int out_target, pid_t pgid, const vector<int> &pipe_fds)
+{
+  pid_t pid;
+  if (_spawnsChild(cmd))
   {
-    return new JobsCommand(cmd_line);
+    // launched stage: fd setup happens in the spawned child, the pipes
+    // first so 2>&1 follows stdout into the pipe
+    if (out_fd != -1)
+      redirections.addDup(out_target, out_fd);
+    if (in_fd != 0)
+      redirections.addDup(0, in_fd);
+    return cmd->spawn(redirections, pgid);
   }
-  else if (firstWord.compare("kill") == 0)
+  // the child must not inherit (and print again) buffered output
+  cout.flush();
+  PhaseTimer fork_timer(ShellStats::PHASE_FORK, ShellStats::KIND_BUILTIN);
+  pid = fork();
+  if (pid == -1)
   {
-    SmallShell &smash = SmallShell::getInstance();
-    return new KillCommand(cmd_line, smash.GetJobsList());
+    perror("smash error: fork failed");
+    return -1;
   }
-  else if (firstWord.compare("cat") == 0)
+  if (pid == 0)
   {
-    return new CatCommand(cmd_line);
+    setpgid(0, pgid);
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+    if (in_fd != 0)
+      dup2(in_fd, 0);
+    if (out_fd != -1)
+      dup2(out_fd, out_target);
+    for (auto ir = pipe_fds.begin(); ir != pipe_fds.end(); ++ir)
+      close(*ir);
+    if (!redirections.apply())
+      exit(1);
+    cmd->execute();
+    cout.flush();
+    exit(last_status);
   }
-  else if (firstWord.compare("quit") == 0)
+  fork_timer.stop();
+  // also from the parent, so later stages can join the group right away
+  setpgid(pid, pgid ? pgid : pid);
+  return pid;
+}
+
+// runs a built-in stage inside the shell with its stdin/stdout (or stderr)
+// temporarily pointed at the pipes
+void SmallShell::runPipeStageInShell(Command *cmd, RedirectionList &redirections, int in_fd, int out_fd, int out_target)
+{
+  cout.flush();
+  int saved_in = (in_fd != 0) ? dup(0) : -1;
+  int saved_out = (out_fd != -1) ? dup(out_target) : -1;
+  if (in_fd != 0)
+    dup2(in_fd, 0);
+  if (out_fd != -1)
+    dup2(out_fd, out_target);
+  PhaseTimer redirect_timer(ShellStats::PHASE_REDIRECT, ShellStats::KIND_BUILTIN);
+  bool redirected = redirections.empty() || redirections.apply();
+  redirect_timer.stop();
+  if (redirected)
   {
-    SmallShell &smash = SmallShell::getInstance();
-    return new QuitCommand(cmd_line, smash.GetJobsList());
+    PhaseTimer execute_timer(ShellStats::PHASE_EXECUTE, ShellStats::KIND_BUILTIN);
+    cmd->execute();
   }
-  else if (firstWord.compare("timeout") == 0)
+  cout.flush();
+  // a reader that quit early leaves cout failed with EPIPE
+  cout.clear();
+  redirections.restore();
+  if (saved_in != -1)
   {
-    return new TimeoutCommand(cmd_line);
+    dup2(saved_in, 0);
+    close(saved_in);
   }
-  else
+  if (saved_out != -1)
   {
-    return new ExternalCommand(cmd_line);
+    dup2(saved_out, out_target);
+    close(saved_out);
   }
-  return nullptr;
 }
 
-// TODO: DEBUG!!!!!!!!
 void SmallShell::executePipeCommand(const char *cmd_line, string &type)
 {
-  int fd[2];
-  DO_SYS(pipe(fd), "pipe");
-  string cmd_line_new(cmd_line);
-  string cmd_line1 = cmd_line_new.substr(0, cmd_line_new.find_first_of(type));
-  string cmd_line2 = cmd_line_new.substr(cmd_line_new.find_first_of(type) + type.length());
-  Command *cmd_1 = CreateCommand(cmd_line1.c_str());
-  Command *cmd_2 = CreateCommand(cmd_line2.c_str());
-  int res = fork();
-  if (res == -1)
+  // split into stages, remembering whether each one pipes stdout or stderr
+  string line(cmd_line);
+  vector<string> stage_lines;
+  vector<int> out_targets;
+  size_t start = 0;
+  for (size_t pos = _findUnquoted(line, '|'); pos != string::npos; pos = _findUnquoted(line, '|', start))
   {
-    perror("smash error: open failed");
+    stage_lines.push_back(line.substr(start, pos - start));
+    bool err_pipe = pos + 1 < line.length() && line[pos + 1] == '&';
+    out_targets.push_back(err_pipe ? 2 : 1);
+    start = pos + (err_pipe ? 2 : 1);
   }
-  if (res == 0)
-  { 
-    // first child
-    if (type.compare("|&") == 0)
+  stage_lines.push_back(line.substr(start));
+  out_targets.push_back(1);
+  size_t num_stages = stage_lines.size();
+
+  // each stage's redirections are applied on top of its pipes
+  vector<RedirectionList> redirections(num_stages);
+  vector<Command *> stages;
+  for (size_t i = 0; i < num_stages; i++)
+  {
+    long long parse_start = _monotonicNs();
+    char *stage_line = command_arena.copyString(stage_lines[i].c_str());
+    // the first stage was expanded with the whole line
+    if (i > 0)
     {
-      DO_SYS(dup2(fd[1], 2), "dup2");
+      stage_line = (char *)expandAliases(stage_line);
     }
-    else
+    if (!redirections[i].parse(stage_line))
+    {
+      last_status = 2;
+      return;
+    }
+    // every stage needs a command: "a |", "| b" and "a | > f" are all errors
+    if (_trim(stage_line).empty())
     {
-      DO_SYS(dup2(fd[1], 1), "dup2");
+      cerr << "smash error: syntax error near unexpected token `|'" << endl;
+      last_status = 2;
+      return;
     }
-    DO_SYS(close(fd[0]), "close");
-    DO_SYS(close(fd[1]), "close");
-    DO_SYS(setpgrp(), "setpgrp");
-    cmd_1->execute();
-    exit(0);
+    long long parse_end = _monotonicNs();
+    stages.push_back(CreateCommand(stage_line));
+    ShellStats::Kind kind = _commandKind(stages.back());
+    recordPhase(ShellStats::PHASE_PARSE, kind, parse_start, parse_end);
+    recordPhase(ShellStats::PHASE_DISPATCH, kind, parse_end, _monotonicNs());
   }
-  // second child
-  int res2 = fork();
-  if (res2 == 0)
+
+  // pipe i connects stage i to stage i + 1
+  vector<int> pipe_fds;
+  for (size_t i = 0; i + 1 < num_stages; i++)
   {
-    DO_SYS(dup2(fd[0], 0), "dup2");
-    DO_SYS(close(fd[0]), "close");
-    DO_SYS(close(fd[1]), "close");
-    DO_SYS(setpgrp(), "setpgrp");
-    cmd_2->execute();
-    exit(0);
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1)
+    {
+      perror("smash error: pipe failed");
+      for (auto ir = pipe_fds.begin(); ir != pipe_fds.end(); ++ir)
+        close(*ir);
+      return;
+    }
+    pipe_fds.push_back(fd[0]);
+    pipe_fds.push_back(fd[1]);
   }
-  if (res2 == -1)
+
+  // one built-in stage at most runs inside the shell, after every other
+  // stage is running. with two, the first could block on a full pipe that
+  // only drains once the shell gets to the second
+  vector<bool> in_shell(num_stages, false);
+  for (size_t i = 0; i < num_stages; i++)
   {
-    perror("smash error: open failed");
+    if (stages[i]->isInShellPipeStage())
+    {
+      in_shell[i] = true;
+      break;
+    }
   }
-  DO_SYS(close(fd[0]), "close");
-  DO_SYS(close(fd[1]), "close");
-  int status;
-  DO_SYS(waitpid(res, &status, 0), "waitpid");
-  DO_SYS(waitpid(res2, &status, 0), "waitpid");
-}
 
-// TODO: DEBUG!!!!!!!!
-int SmallShell::prepareRedirectionCommand(char *cmd_line, string &type)
-{
-  string cmd_line_new(cmd_line);
-  strcpy(cmd_line, cmd_line_new.substr(0, cmd_line_new.find_first_of(type)).c_str());
-  string file_name = _trim(cmd_line_new.substr(cmd_line_new.find_first_of(type) + type.length()));
-  int fd_stdout = dup(1);
-  if (fd_stdout == -1)
+  // all launched stages go into the process group of the first one
+  pid_t pgid = 0;
+  PipeCommand *pipeline = command_arena.create<PipeCommand>(cmd_line);
+  vector<pid_t> &stage_pids = pipeline->GetStagePids();
+  vector<size_t> stage_indexes;
+  vector<long long> stage_starts(num_stages);
+  pid_t last_pid = -1;
+  for (size_t i = 0; i < num_stages; i++)
   {
-    perror("smash error: dup failed");
-    return -1;
+    if (in_shell[i])
+      continue;
+    int in_fd = (i > 0) ? pipe_fds[2 * (i - 1)] : 0;
+    int out_fd = (i + 1 < num_stages) ? pipe_fds[2 * i + 1] : -1;
+    stage_starts[i] = _monotonicNs();
+    pid_t pid = launchPipeStage(stages[i], redirections[i], in_fd, out_fd, out_targets[i], pgid, pipe_fds);
+    if (pid == -1)
+    {
+      if (i + 1 == num_stages)
+        last_status = 127;
+      continue;
+    }
+    if (pgid == 0)
+      pgid = pid;
+    stages[i]->SetPid(pid);
+    if (typeid(*stages[i]) == typeid(TimeoutCommand))
+      times_list.addToTimesList(promoteCommand(stages[i]), pid, ((TimeoutCommand *)stages[i])->GetDurationMs());
+    stage_pids.push_back(pid);
+    stage_indexes.push_back(i);
+    if (i + 1 == num_stages)
+      last_pid = pid;
   }
-  int fd;
-  if (close(1) == -1)
+  // ctrl-C and ctrl-Z go to the launched stages
+  SetCommand(pipeline);
+  // the shell keeps only the pipe ends its own stages use
+  for (size_t i = 0; i + 1 < num_stages; i++)
   {
-    perror("smash error: close failed");
-    close(fd_stdout);
-    return -1;
+    if (!in_shell[i])
+    {
+      close(pipe_fds[2 * i + 1]);
+      pipe_fds[2 * i + 1] = -1;
+    }
+    if (!in_shell[i + 1])
+    {
+      close(pipe_fds[2 * i]);
+      pipe_fds[2 * i] = -1;
+    }
   }
-  if (type.compare(">>") == 0)
+  for (size_t i = 0; i < num_stages; i++)
   {
-    fd = open(file_name.c_str(), O_CREAT | O_RDWR | O_APPEND, 0666); //perror wrap
+    if (!in_shell[i])
+      continue;
+    int in_fd = (i > 0) ? pipe_fds[2 * (i - 1)] : 0;
+    int out_fd = (i + 1 < num_stages) ? pipe_fds[2 * i + 1] : -1;
+    stage_starts[i] = _monotonicNs();
+    runPipeStageInShell(stages[i], redirections[i], in_fd, out_fd, out_targets[i]);
+    if (trace.isOn())
+      trace.span(("stage " + to_string(i + 1)).c_str(), "pipeline", stage_starts[i], _monotonicNs(), shell_pid, stages[i]->GetCmd_line());
+    if (in_fd != 0)
+      close(in_fd);
+    if (out_fd != -1)
+      close(out_fd);
   }
-  else
+
+  // the last stage decides the status. in the trace a launched stage runs on
+  // its own row (its pid) until it is reaped
+  for (size_t j = 0; j < stage_pids.size(); j++)
   {
-    fd = open(file_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0666);
+    int status;
+    DO_SYS(waitForChild(stage_pids[j], &status, WUNTRACED), "waitpid");
+    if (WIFSTOPPED(status))
+    {
+      last_status = _exitStatus(status);
+      // the pipeline becomes one stopped job under its last stage's pid,
+      // the sweep reaps the other stages not reaped yet
+      for (size_t k = j; k + 1 < stage_pids.size(); k++)
+        jobs_list.addStray(stage_pids[k]);
+      RemoveFinishedJobs();
+      jobs_list.addJob(promoteCommand(pipeline), pipeline->GetPid(), true);
+      return;
+    }
+    times_list.cancelTimeout(stage_pids[j]);
+    cgroups.release(stage_pids[j]);
+    affinity.release(stage_pids[j]);
+    if (stage_pids[j] == last_pid)
+      last_status = _exitStatus(status);
+    size_t i = stage_indexes[j];
+    if (trace.isOn())
+      trace.span(("stage " + to_string(i + 1)).c_str(), "pipeline", stage_starts[i], _monotonicNs(), stage_pids[j], stages[i]->GetCmd_line());
   }
-  if (fd == -1)
+}
+
+void SmallShell::executeCommand(const char *cmd_line)
+{
+  long long start = _monotonicNs();
+  runCommand(cmd_line);
+  // the line is done: its commands and their parse data go away together
+  if (trace.isOn())
   {
-    perror("smash error: open failed");
-    dup2(fd_stdout, 1);
-    return -1;
+    trace.span("line", "line", start, _monotonicNs(), shell_pid, cmd_line);
+    trace.flush();
   }
-  return fd_stdout;
+  current_cmd = nullptr;
+  command_arena.reset();
 }
 
-void SmallShell::executeCommand(const char *cmd_line)
+void SmallShell::runCommand(const char *cmd_line)
 {
-  char *cmd_line_new = strdup(const_cast<char *>(cmd_line));
+  // blank lines (common in scripts) are a no-op
+  if (string(cmd_line).find_first_not_of(WHITESPACE) == string::npos)
+  {
+    return;
+  }
+  long long parse_start = _monotonicNs();
+  cmd_line = expandAliases(cmd_line);
+  last_status = 0;
+  // an alias may expand to nothing
+  if (string(cmd_line).find_first_not_of(WHITESPACE) == string::npos)
+  {
+    return;
+  }
   bool is_background = _isBackgroundComamnd(cmd_line);
-  string redirection_type;
   string pipe_type;
-  bool redirection = _isRedirectionCommand(cmd_line, redirection_type);
   bool pipe = _isPipeCommand(cmd_line, pipe_type);
   if (pipe)
   {
     executePipeCommand(cmd_line, pipe_type);
     return;
   }
-  int fd_stdout = 0;
-  if (redirection)
+  char *cmd_line_new = command_arena.copyString(cmd_line);
+  RedirectionList redirections;
+  if (!redirections.parse(cmd_line_new))
   {
-    fd_stdout = prepareRedirectionCommand(cmd_line_new, redirection_type); // careful with this one
-    if (fd_stdout == -1) {
-      return;
-    }
+    last_status = 2;
+    return;
+  }
+  // nothing is left to run once the redirections are gone ("> file")
+  if (_trim(cmd_line_new).empty())
+  {
+    return;
   }
+  long long parse_end = _monotonicNs();
   Command *cmd = CreateCommand(cmd_line_new);
+  // the kind of command is only known after dispatch
+  ShellStats::Kind kind = _commandKind(cmd);
+  recordPhase(ShellStats::PHASE_PARSE, kind, parse_start, parse_end);
+  recordPhase(ShellStats::PHASE_DISPATCH, kind, parse_end, _monotonicNs());
+  long long timeout_ms = -1;
+  if (typeid(*cmd) == typeid(TimeoutCommand))
+  {
+    timeout_ms = ((TimeoutCommand *)cmd)->GetDurationMs();
+  }
   //External Command:
-  if (typeid(*cmd) == typeid(ExternalCommand) || typeid(*cmd) == typeid(TimeoutCommand))
+  if (_spawnsChild(cmd))
   { 
     if (is_background){
       cmd->SetForeground(false);
     }
     SetCommand(cmd);
-    int duration = -1;
-    pid_t pid = fork();
+    pid_t pid = cmd->spawn(redirections, 0);
     if (pid == -1)
     {
-      perror("smash error: fork failed");
-    }
-    // child
-    if (pid == 0)
-    {
-      DO_SYS(setpgrp(), "setpgrp");
-      cmd->execute();
-      exit(0);
+      last_status = 127;
     }
-    // parent
     else
     {
       cmd->SetPid(pid);
-      if (typeid(*cmd) == typeid(TimeoutCommand)) {
-        char *args[20];
-        _parseCommandLine(cmd->GetCmd_line(), args);
-        duration = atoi(args[1]);
-        if (times_list.GetClosestAlarm() == 0 || times_list.GetClosestAlarm() > duration){
-          // cout << "set alarm for duration:" << duration << endl; //DEBUGPRINT
-          alarm(duration);
-        }
-        times_list.addToTimesList(cmd, pid, duration);
+      // jobs and timed commands outlive the line
+      shared_ptr<Command> owned;
+      if (timeout_ms != -1 || is_background) {
+        owned = promoteCommand(cmd);
+      }
+      if (timeout_ms != -1) {
+        times_list.addToTimesList(owned, pid, timeout_ms);
       }
       SmallShell &smash = SmallShell::getInstance();
       if (is_background)
       {
         smash.RemoveFinishedJobs();
-        jobs_list.addJob(cmd, pid, false);
+        jobs_list.addJob(owned, pid, false);
       }
       else
       {
         int status;
-        DO_SYS(waitpid(pid, &status, WUNTRACED), "waitpid");
+        DO_SYS(waitForChild(pid, &status, WUNTRACED), "waitpid");
+        last_status = _exitStatus(status);
         if (WIFSTOPPED(status))
         {
           smash.RemoveFinishedJobs();
-          jobs_list.addJob(cmd, pid, true);
+          jobs_list.addJob(owned ? owned : promoteCommand(cmd), pid, true);
           return;
         }
+        times_list.cancelTimeout(pid);
+        cgroups.release(pid);
+        affinity.release(pid);
       }
     }
   }
   // Built in Commands:
   else
   {
-    cmd->execute();
-    // delete cmd;
-  }
-  if (redirection)
-  {
-    DO_SYS(dup2(fd_stdout, 1), "dup2");
-    DO_SYS(close(fd_stdout), "close");
+    // built-ins are the only commands that redirect the shell's own fds
+    cout.flush();
+    PhaseTimer redirect_timer(ShellStats::PHASE_REDIRECT, ShellStats::KIND_BUILTIN);
+    bool redirected = redirections.empty() || redirections.apply();
+    redirect_timer.stop();
+    if (redirected)
+    {
+      PhaseTimer execute_timer(ShellStats::PHASE_EXECUTE, ShellStats::KIND_BUILTIN);
+      cmd->execute();
+    }
+    else
+    {
+      last_status = 1;
+    }
+    cout.flush();
+    cout.clear();
+    redirections.restore();
   }
 }
 
@@ -3,27 +3,148 @@
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <deque>
+#include <sys/resource.h>
+#include <string>
+#include <spawn.h>
+#include <iostream>
+#include <stdint.h>
+#include <type_traits>
+#include "smash_plugin.h"
 
 #define COMMAND_ARGS_MAX_LENGTH (200)
 #define COMMAND_MAX_ARGS (20)
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define COMMAND_ARENA_BLOCK_SIZE (1 << 14)
+#define TRACE_BUFFER_SIZE (1 << 16)
 
 using namespace std;
 
 bool _isBackgroundComamnd(const char *cmd_line);
 
+class Command;
+
+// bump allocator for everything one command line needs: the Command objects,
+// their copies of the line and their argv. reset() destroys the commands and
+// rewinds it once the line has run, so a prompt allocates nothing after the
+// first few. commands that outlive their line (jobs, timed commands) are
+// promoted to owned heap copies first, see SmallShell::promoteCommand.
+class CommandArena {
+  std::vector<char*> blocks;
+  std::vector<size_t> block_sizes;
+  size_t current_block;
+  size_t used; // bytes used in the current block
+  std::vector<Command*> commands; // created here, destroyed by reset()
+ public:
+  CommandArena();
+  CommandArena(CommandArena const&) = delete;
+  void operator=(CommandArena const&) = delete;
+  ~CommandArena();
+  void* allocate(size_t size);
+  char* copyString(const char* str);
+  bool owns(const void* ptr);
+  template <class T, class... Args> T* create(Args&&... args)
+  {
+    T* cmd = new (*this) T(std::forward<Args>(args)...);
+    commands.push_back(cmd);
+    return cmd;
+  }
+  void reset();
+};
+
+// the words of a command line, split once when the command is created.
+// the storage comes from the arena if one is given, from the heap otherwise.
+class CommandArgs {
+  char* buffer;
+  char** argv;
+  int argc;
+  CommandArena* arena;
+ public:
+  explicit CommandArgs(const char* cmd_line, CommandArena* arena = NULL);
+  CommandArgs(CommandArgs const&) = delete;
+  void operator=(CommandArgs const&) = delete;
+  ~CommandArgs();
+  int size();
+  char* operator[](int i); // NULL past the last word
+  char** data(); // NULL terminated, usable as argv
+};
+
+// the <, >, >>, 2>, 2>&1 and &> redirections of one command, in the order
+// they were written. they are cut out of the command line when parsed and
+// applied in the child at spawn time; only built-ins apply them in the shell.
+class RedirectionList {
+ public:
+  struct Redirection {
+    int fd;          // the fd being redirected
+    int dup_fd;      // n>&m copies fd m, -1 for a file
+    std::string file;
+    int flags;       // open flags for a file
+  };
+ private:
+  std::vector<Redirection> redirections;
+  std::vector<std::pair<int, int>> saved_fds; // fd -> copy to restore, -1 if it was closed
+ public:
+  RedirectionList() = default;
+  RedirectionList(RedirectionList const&) = delete;
+  void operator=(RedirectionList const&) = delete;
+  ~RedirectionList();
+  bool parse(char* cmd_line); // removes the redirections from the line, false on a syntax error
+  bool empty();
+  void addDup(int fd, int dup_fd); // ahead of the parsed ones, for pipe ends
+  void addSpawnActions(posix_spawn_file_actions_t *actions);
+  bool apply();   // in the current process, keeping copies of the replaced fds
+  const char* applyInChild() const; // the failed call's error prefix, or NULL
+  void restore(); // puts the replaced fds back
+};
+
+// cout's buffer while the shell runs: built-in output collects here and goes
+// out with one write(2) per flush (end of command, before waiting on a child,
+// or when full) instead of one per line
+class OutputBuffer : public std::streambuf {
+  char buffer[OUTPUT_BUFFER_SIZE];
+  int fd;
+  std::ostream* stream;
+  std::streambuf* previous;
+ protected:
+  int overflow(int c) override;
+  int sync() override;
+ public:
+  explicit OutputBuffer(int fd);
+  OutputBuffer(OutputBuffer const&) = delete;
+  void operator=(OutputBuffer const&) = delete;
+  ~OutputBuffer();
+  void install(std::ostream& new_stream);
+};
+
 class Command {
+  CommandArena* arena; // the arena this command lives in, NULL for heap commands
   const char* cmd_line;
+  CommandArgs args;
   bool foreground;
  public:
+  // copies cmd_line, into the arena if the command was created there
   Command(const char* cmd_line);
   // Command(const char* cmd_line, bool fg);
-  virtual ~Command() {free((char*)cmd_line);}
+  virtual ~Command();
+  static void* operator new(size_t size) {return ::operator new(size);};
+  static void* operator new(size_t size, CommandArena& arena) {return arena.allocate(size);};
+  static void operator delete(void* ptr) {::operator delete(ptr);};
+  static void operator delete(void* ptr, CommandArena& arena) {};
   virtual void execute() = 0;
   const char* GetCmd_line();
+  CommandArgs& GetArgs();
   bool isForeground();
   void SetForeground(bool fg);
   virtual void SetPid(pid_t new_pid) {};
   virtual pid_t GetPid() {return -1;};
+  // the processes ctrl-C/ctrl-Z reach while the command is in the foreground
+  virtual std::vector<pid_t> GetForegroundPids() {return std::vector<pid_t>(1, GetPid());};
+  // launches the command into process group pgid (0 for a new one), its fds
+  // redirected in the child, without running anything in the shell
+  virtual pid_t spawn(RedirectionList& fds, pid_t pgid) {return -1;};
+  // built-ins that only read/print (no shell state changes) run as pipeline stages inside the shell
+  virtual bool isInShellPipeStage() {return false;};
 };
 
 class BuiltInCommand : public Command {
@@ -39,16 +160,23 @@ class ExternalCommand : public Command {
   ExternalCommand(const char* cmd_line, bool fg);
   virtual ~ExternalCommand() {}
   void execute() override;
+  pid_t spawn(RedirectionList& fds, pid_t pgid) override;
   void SetPid(pid_t new_pid) override;
   pid_t GetPid() override;
 };
 
+// a pipeline while the shell waits for it, and as a job once stopped:
+// ctrl-C, ctrl-Z, fg, bg and kill reach every stage it launched
 class PipeCommand : public Command {
-  // TODO: Add your data members
+  std::vector<pid_t> stage_pids; // in launch order, the first leads the process group
  public:
   PipeCommand(const char* cmd_line);
   virtual ~PipeCommand() {}
   void execute() override;
+  void addStage(pid_t pid);
+  std::vector<pid_t>& GetStagePids();
+  pid_t GetPid() override; // the last stage's
+  std::vector<pid_t> GetForegroundPids() override; // the stages not reaped yet
 };
 
 class RedirectionCommand : public Command {
@@ -88,6 +216,7 @@ class ShowPidCommand : public BuiltInCommand {
   ShowPidCommand(const char* cmd_line);
   virtual ~ShowPidCommand() {}
   void execute() override;
+  bool isInShellPipeStage() override {return true;};
 };
 
 class PwdCommand : public BuiltInCommand {
@@ -95,6 +224,7 @@ class PwdCommand : public BuiltInCommand {
   PwdCommand(const char* cmd_line);
   virtual ~PwdCommand() {}
   void execute() override;
+  bool isInShellPipeStage() override {return true;};
 };
 
 class CdCommand : public BuiltInCommand {
@@ -107,24 +237,48 @@ class CdCommand : public BuiltInCommand {
 class JobsList;
 
 class QuitCommand : public BuiltInCommand {
-  shared_ptr<JobsList> jobs;
+  JobsList& jobs;
 public:
-  QuitCommand(const char* cmd_line, shared_ptr<JobsList> jobs);
+  QuitCommand(const char* cmd_line, JobsList& jobs);
   virtual ~QuitCommand() {}
   void execute() override;
 };
 
+#define FINISHED_JOBS_MAX (16)
+
 class JobsList {
   public:
+  // cpu, memory and scheduling numbers of a job
+  struct JobUsage {
+   double user_secs;
+   double sys_secs;
+   long max_rss_kb;
+   long vol_ctxsw;
+   long invol_ctxsw;
+   JobUsage();
+   explicit JobUsage(const struct rusage& usage);
+   bool readProc(pid_t pid);
+   void print();
+  };
+  // what is kept of a job once it has been reaped
+  struct FinishedJob {
+   int job_id;
+   pid_t pid;
+   std::string cmd_line;
+   int exit_status;
+   time_t run_secs;
+   JobUsage usage;
+  };
   class JobEntry {
    int job_id;
    pid_t pid;
-   Command* cmd;
+   std::shared_ptr<Command> cmd;
    bool is_stopped;
    time_t time;
+   int group_id; // jobs started together (by parallel) share one, 0 otherwise
    public:
    JobEntry();
-   JobEntry(int job_id, pid_t pid, Command* cmd, bool is_stopped, time_t init_time);
+   JobEntry(int job_id, pid_t pid, std::shared_ptr<Command> cmd, bool is_stopped, time_t init_time);
    ~JobEntry();
    bool isStopped();
    void SetIsStopped(bool is_stopped);
@@ -133,19 +287,35 @@ class JobsList {
    const char* GetCommandLine();
    time_t GetTime();
    Command* GetCommand();
+   std::shared_ptr<Command> GetCommandPtr();
+   int GetGroupId();
+   void SetGroupId(int group_id);
+   int sendSignal(int signum); // to every process of the job, -1 with errno set on failure
   };
   private:
+  // slot table indexed by job id (slot 0 unused), sized max_job_id + 1
   std::vector<std::shared_ptr<JobEntry>> jobs_list;
+  std::unordered_map<pid_t, std::shared_ptr<JobEntry>> jobs_by_pid;
   int max_job_id;
+  int num_jobs;
+  std::deque<FinishedJob> finished_jobs; // oldest first, at most FINISHED_JOBS_MAX
+  int max_group_id;
+  std::vector<pid_t> stray_pids; // stages of pipeline jobs besides the job's own pid
+  bool collectJob(std::shared_ptr<JobEntry> job);
+  bool collectStray(pid_t pid);
  public:
   JobsList();
   ~JobsList();
-  void addJob(Command* cmd, pid_t pid, bool isStopped);
-  void addJobWithId(Command* cmd, pid_t pid, int job_id, bool isStopped);
+  void addJob(std::shared_ptr<Command> cmd, pid_t pid, bool isStopped);
+  void addJobWithId(std::shared_ptr<Command> cmd, pid_t pid, int job_id, bool isStopped);
+  void addStray(pid_t pid); // reaped by the sweep, nothing reported
   void printJobsList();
+  void printJobsDetails();
   void killAllJobs();
   void clearJobsList();
   void removeFinishedJobs();
+  void addFinishedJob(std::shared_ptr<JobEntry> job, int status, const struct rusage& usage);
+  void waitForState(std::shared_ptr<JobEntry> job, bool stopped);
   std::shared_ptr<JobEntry> getJobById(int jobId);
   std::shared_ptr<JobEntry> getJobByPid(pid_t pid);
   void removeJobById(int jobId);
@@ -153,6 +323,7 @@ class JobsList {
   std::shared_ptr<JobEntry> getLastStoppedJob();
   JobEntry *getLastStoppedJob(int *jobId);
   int findMaxJobId();
+  int newGroupId();
 };
 
 class JobsCommand : public BuiltInCommand {
@@ -160,28 +331,29 @@ class JobsCommand : public BuiltInCommand {
   JobsCommand(const char* cmd_line);
   virtual ~JobsCommand() {}
   void execute() override;
+  bool isInShellPipeStage() override {return true;};
 };
 
 class KillCommand : public BuiltInCommand {
-  std::shared_ptr<JobsList> jobs;
+  JobsList& jobs;
  public:
-  KillCommand(const char* cmd_line, std::shared_ptr<JobsList> jobs);
+  KillCommand(const char* cmd_line, JobsList& jobs);
   virtual ~KillCommand() {}
   void execute() override;
 };
 
 class ForegroundCommand : public BuiltInCommand {
-  std::shared_ptr<JobsList> jobs;
+  JobsList& jobs;
  public:
-  ForegroundCommand(const char* cmd_line, std::shared_ptr<JobsList> jobs);
+  ForegroundCommand(const char* cmd_line, JobsList& jobs);
   virtual ~ForegroundCommand() {}
   void execute() override;
 };
 
 class BackgroundCommand : public BuiltInCommand {
- std::shared_ptr<JobsList> jobs;
+ JobsList& jobs;
  public:
-  BackgroundCommand(const char* cmd_line, std::shared_ptr<JobsList> jobs);
+  BackgroundCommand(const char* cmd_line, JobsList& jobs);
   virtual ~BackgroundCommand() {}
   void execute() override;
 };
@@ -191,6 +363,29 @@ class CatCommand : public BuiltInCommand {
   CatCommand(const char* cmd_line);
   virtual ~CatCommand() {}
   void execute() override;
+  bool isInShellPipeStage() override {return true;};
+};
+
+class ParallelCommand : public BuiltInCommand {
+  struct Task {
+   std::string cmd_line;
+   pid_t pid;
+   int pid_fd;
+   int job_id;
+   long long start; // CLOCK_MONOTONIC milliseconds
+   long long finish;
+   int exit_status;
+   bool stopped; // by ctrl-Z, left in the jobs list
+   explicit Task(std::string cmd_line);
+  };
+  std::vector<Task*> running; // the tasks alive while run() goes on
+  void run(std::vector<Task>& tasks, int max_running);
+  void collectStopped();
+ public:
+  ParallelCommand(const char* cmd_line);
+  virtual ~ParallelCommand() {}
+  void execute() override;
+  std::vector<pid_t> GetForegroundPids() override;
 };
 
 /* ---- TIMED COMMANDS ---- */
@@ -199,27 +394,36 @@ class TimesList {
   public:
   class TimeEntry {
    pid_t pid;
-   Command* cmd;
-   time_t init_time;
-   time_t finish_time; //finish_time = (time stamp at start) + (duration)
+   std::shared_ptr<Command> cmd;
+   long long init_time; // CLOCK_MONOTONIC milliseconds
+   long long finish_time; //finish_time = (time stamp at start) + (duration)
+   bool cancelled;
    public:
    TimeEntry();
-   TimeEntry(pid_t pid, Command* cmd, time_t init_time, time_t finish_time);
+   TimeEntry(pid_t pid, std::shared_ptr<Command> cmd, long long init_time, long long finish_time);
    ~TimeEntry() { };
    pid_t GetPid();
    const char* GetCommandLine();
-   time_t GetFinishTime();
-   time_t GetDuration();
+   long long GetFinishTime();
+   long long GetDuration();
    Command* GetCommand();
+   bool isCancelled();
+   void Cancel();
   };
   private:
- public:
+  // min-heap on finish time, cancelled entries are dropped once they reach the top
   std::vector<std::shared_ptr<TimeEntry>> times_list;
+  std::unordered_map<pid_t, std::shared_ptr<TimeEntry>> times_by_pid;
+  int timer_fd; // CLOCK_MONOTONIC timerfd armed for the closest deadline
+  void popCancelled();
+  void armTimer();
+ public:
   TimesList();
-  ~TimesList() {};
-  void addToTimesList(Command* cmd, pid_t pid, time_t duration);
-  time_t GetClosestAlarm();
-  void printTimesList();
+  ~TimesList();
+  int GetTimerFd();
+  void addToTimesList(std::shared_ptr<Command> cmd, pid_t pid, long long duration_ms);
+  void cancelTimeout(pid_t pid);
+  long long GetClosestAlarm();
   void killFinishedAlarms();
 };
 
@@ -228,13 +432,465 @@ class TimeoutCommand : public BuiltInCommand {
  public:
   TimeoutCommand(const char* cmd_line);
   virtual ~TimeoutCommand() {}
+  long long GetDurationMs(); // -1 if the arguments are invalid
   void execute() override;
+  pid_t spawn(RedirectionList& fds, pid_t pgid) override;
   void SetPid(pid_t new_pid) override;
   pid_t GetPid() override;
 };
 
 
 
+/* ---- CGROUPS ---- */
+
+#define CGROUP_CPU_PERIOD_US (100000)
+
+// a cgroup v2 directory per command started with limit, created under
+// <base>/smash-<shell pid>. the base is $SMASH_CGROUP, or the shell's own
+// cgroup, and has to be able to hand memory, cpu and pids down to it.
+// a job's cgroup goes away once the job is reaped and the cgroup is empty.
+class CgroupList {
+  public:
+  // values as written to memory.max, cpu.max and pids.max, empty if unset
+  struct Limits {
+   std::string memory_max;
+   std::string cpu_max;
+   std::string pids_max;
+   bool empty();
+   bool parseOption(const char* option, const char* value);
+  };
+  private:
+  std::string root; // empty until the first limit
+  std::string base; // the cgroup root was made under
+  std::string shell_leaf; // where the shell moved to out of base, empty if it did not
+  std::vector<std::string> base_controllers; // the ones turned on in base for root
+  std::unordered_map<pid_t, std::string> cgroups_by_pid;
+  std::vector<std::string> lingering; // reaped jobs whose cgroup still had processes
+  int max_cgroup_id;
+  pid_t owner; // forked children inherit the list but never remove cgroups
+  bool setup();
+  bool removeCgroup(const std::string& path);
+  bool hasController(const char* name);
+ public:
+  CgroupList();
+  CgroupList(CgroupList const&) = delete;
+  void operator=(CgroupList const&) = delete;
+  ~CgroupList();
+  std::string create(const Limits& limits); // empty on failure
+  bool setLimits(const std::string& path, const Limits& limits);
+  void add(pid_t pid, const std::string& path);
+  void release(pid_t pid);
+  std::string find(pid_t pid); // empty if the process has no cgroup
+  bool killAll(pid_t pid); // cgroup.kill: the job and everything it started
+  void printUsage(pid_t pid);
+};
+
+// limit [--mem size] [--cpu cpus] [--pids n] command: runs the command in a
+// cgroup of its own. limit -j job-id [options] changes a job's limits.
+class LimitCommand : public BuiltInCommand {
+  pid_t pid;
+  CgroupList::Limits limits;
+  int job_id; // -j, 0 when starting a command
+  int cmd_word; // the first word of the limited command, 0 if none
+  bool valid;
+ public:
+  LimitCommand(const char* cmd_line);
+  virtual ~LimitCommand() {}
+  bool hasCommand();
+  void execute() override;
+  pid_t spawn(RedirectionList& fds, pid_t pgid) override;
+  void SetPid(pid_t new_pid) override;
+  pid_t GetPid() override;
+};
+
+/* ---- CPU AFFINITY ---- */
+
+// which cpus jobs run on. pin names a job's cpus; the shell-wide policy gives
+// every new background job a core of its own (all its hardware threads):
+// spread balances the jobs over the NUMA nodes, compact fills one node before
+// the next. the cores are the ones the shell may run on, grouped by node as
+// sysfs lists them, and a core is free again once its job is reaped.
+class AffinityList {
+  public:
+  enum Policy {AFFINITY_NONE, AFFINITY_SPREAD, AFFINITY_COMPACT};
+  struct Core {
+   int node;
+   std::vector<int> cpus;
+   int jobs; // jobs the policy put on it
+  };
+  struct Assignment {
+   std::vector<int> cpus;
+   int core; // index into cores, -1 for a pinned job
+  };
+  private:
+  Policy policy;
+  bool loaded;
+  std::vector<Core> cores; // node by node, in cpu order
+  std::vector<int> node_jobs;
+  std::unordered_map<pid_t, Assignment> assignments;
+  void loadTopology();
+ public:
+  AffinityList();
+  static const char* policyName(Policy policy);
+  static bool parsePolicy(const char* name, Policy* policy);
+  Policy GetPolicy();
+  void SetPolicy(Policy new_policy);
+  bool pick(Assignment& assignment); // cpus for a new background job, by the policy
+  void add(pid_t pid, const Assignment& assignment); // once it runs on them
+  void release(pid_t pid);
+  std::string describe(pid_t pid); // "cpus 2-3", empty if the shell never placed it
+};
+
+bool _parseCpuList(const char* list, std::vector<int>& cpus);
+std::string _formatCpuList(const std::vector<int>& cpus);
+
+// pin cpulist command: runs the command on the listed cpus (0-3,8)
+class PinCommand : public BuiltInCommand {
+  pid_t pid;
+  std::vector<int> cpus;
+  bool valid;
+ public:
+  PinCommand(const char* cmd_line);
+  virtual ~PinCommand() {}
+  bool hasCommand();
+  void execute() override;
+  pid_t spawn(RedirectionList& fds, pid_t pgid) override;
+  void SetPid(pid_t new_pid) override;
+  pid_t GetPid() override;
+};
+
+/* ---- SCHEDULING ---- */
+
+// how a launched child is scheduled: its nice value, cpu scheduling policy
+// and io priority. unset fields are inherited from the shell.
+struct LaunchPriority {
+  bool has_nice;
+  int nice; // added to the shell's own, like nice(1)
+  int policy; // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, -1 if unset
+  int ioprio; // an ioprio_set value, -1 if unset
+  LaunchPriority();
+  bool empty();
+  bool parseNice(const char* adjustment);
+  bool parsePolicy(const char* name);
+  bool parseIoPriority(const std::string& io_class, const char* level);
+  bool parseIoSpec(const char* spec); // class[/level]
+  LaunchPriority withDefaults(const LaunchPriority& defaults) const; // unset fields from defaults
+  bool needsChild() const; // something posix_spawn cannot set
+  static const char* policyName(int policy);
+  static std::string ioPriorityName(int ioprio);
+};
+
+// nice [-n adjustment] command, sched batch|idle|other command,
+// ionice -c class [-n level] command or ionice class[/level] command.
+// they chain: nice -n 5 ionice idle make. other forms of nice and ionice
+// run the system's
+class PriorityCommand : public BuiltInCommand {
+  pid_t pid;
+  LaunchPriority priority;
+  int cmd_word; // the first word of the command it runs, 0 if invalid
+ public:
+  PriorityCommand(const char* cmd_line);
+  virtual ~PriorityCommand() {}
+  bool hasCommand();
+  void execute() override;
+  pid_t spawn(RedirectionList& fds, pid_t pgid) override;
+  void SetPid(pid_t new_pid) override;
+  pid_t GetPid() override;
+};
+
+// renice [-n] priority job-id: the nice value of the job's whole process group
+class ReniceCommand : public BuiltInCommand {
+  JobsList& jobs;
+ public:
+  ReniceCommand(const char* cmd_line, JobsList& jobs);
+  virtual ~ReniceCommand() {}
+  void execute() override;
+};
+
+// set: shell-wide options. set affinity spread|compact|none, and what
+// background jobs start with: set nice n, set sched batch|idle|other,
+// set ionice class[/level]. none drops a default.
+class SetOptionCommand : public BuiltInCommand {
+ public:
+  SetOptionCommand(const char* cmd_line);
+  virtual ~SetOptionCommand() {}
+  void execute() override;
+};
+
+/* ---- COMMAND PATH CACHE ---- */
+
+#define PATH_CACHE_RECHECK_SECS (1)
+
+// command name -> absolute path, like bash's hash table. misses are cached
+// too (as an empty path); everything is dropped when PATH or one of its
+// directories changes.
+class PathCache {
+  public:
+  class PathEntry {
+   std::string path;
+   int hits;
+   public:
+   PathEntry();
+   explicit PathEntry(std::string path);
+   const std::string& GetPath();
+   bool isMiss();
+   int GetHits();
+   void AddHit();
+  };
+  private:
+  std::unordered_map<std::string, PathEntry> entries;
+  std::string key; // the name being looked up
+  std::string path_var; // the PATH the entries were resolved against
+  std::vector<std::string> dirs;
+  std::vector<time_t> dir_mtimes;
+  time_t last_check;
+  void checkValid();
+  std::string search(const std::string& name);
+ public:
+  PathCache();
+  ~PathCache() {};
+  const std::string& lookup(const char* name); // "" if not found
+  bool add(const std::string& name);
+  void forget(const std::string& name);
+  void clear();
+  void printPathCache();
+};
+
+class HashCommand : public BuiltInCommand {
+ public:
+  HashCommand(const char* cmd_line);
+  virtual ~HashCommand() {}
+  void execute() override;
+};
+
+/* ---- BUILT-IN TABLE ---- */
+
+#define BUILTIN_TABLE_MIN_SLOTS (64)
+#define ALIAS_EXPANSION_MAX (16)
+
+// FNV-1a of a command name. the constexpr version lets REGISTER_BUILTIN hash
+// the name at compile time, the other one hashes a word of the line in place.
+constexpr uint32_t _hashName(const char* name, uint32_t hash = 2166136261u)
+{
+  return *name ? _hashName(name + 1, (hash ^ (unsigned char)*name) * 16777619u) : hash;
+}
+uint32_t _hashWord(const char* word, size_t length);
+
+// command name -> built-in factory and/or alias, open addressing with linear
+// probing over a power of two number of slots. an alias shadows a built-in
+// of the same name until it is removed.
+class BuiltinTable {
+ public:
+  typedef Command* (*Factory)(const char* cmd_line);
+  class BuiltinEntry {
+   std::string name;
+   uint32_t hash;
+   Factory factory; // NULL if the name is only an alias
+   std::string alias;
+   bool is_alias;
+   public:
+   BuiltinEntry();
+   BuiltinEntry(std::string name, uint32_t hash);
+   const std::string& GetName();
+   uint32_t GetHash();
+   bool isFree();
+   Factory GetFactory();
+   void SetFactory(Factory new_factory);
+   bool isAlias();
+   const std::string& GetAlias();
+   void SetAlias(std::string new_alias);
+   void RemoveAlias();
+  };
+  private:
+  std::vector<BuiltinEntry> slots;
+  size_t num_entries;
+  BuiltinTable();
+  BuiltinEntry* find(const char* name, size_t length, uint32_t hash);
+  BuiltinEntry* insert(const char* name, size_t length, uint32_t hash);
+ public:
+  BuiltinTable(BuiltinTable const&) = delete;
+  void operator=(BuiltinTable const&) = delete;
+  static BuiltinTable& getInstance();
+  void addBuiltin(const char* name, uint32_t hash, Factory factory);
+  Factory replaceBuiltin(const std::string& name, Factory factory); // returns the previous one
+  BuiltinEntry* lookup(const char* name, size_t length); // NULL if unknown
+  void setAlias(const std::string& name, const std::string& value);
+  bool removeAlias(const std::string& name);
+  void clearAliases();
+  void printAliases();
+
+  // registers a built-in while the program starts, see REGISTER_BUILTIN
+  struct Registrar {
+    Registrar(const char* name, uint32_t hash, Factory factory);
+  };
+};
+
+class AliasCommand : public BuiltInCommand {
+ public:
+  AliasCommand(const char* cmd_line);
+  virtual ~AliasCommand() {}
+  void execute() override;
+};
+
+class UnaliasCommand : public BuiltInCommand {
+ public:
+  UnaliasCommand(const char* cmd_line);
+  virtual ~UnaliasCommand() {}
+  void execute() override;
+};
+
+/* ---- STATISTICS ---- */
+
+#define STATS_BUCKETS (40) // bucket i: [2^i, 2^(i+1)) ns, the last one is open ended
+
+// call counts and log2 latency histograms of the shell's hot paths, per
+// phase and per kind of command. always on: recording is a clock read and a
+// few increments.
+class ShellStats {
+ public:
+  enum Phase {
+   PHASE_PARSE,    // alias expansion and redirection parsing
+   PHASE_DISPATCH, // built-in table lookup and command creation (argv split)
+   PHASE_REDIRECT, // applying redirections in the shell / as spawn actions
+   PHASE_LOOKUP,   // PATH search through the cache
+   PHASE_SPAWN,    // posix_spawn: fork and exec of an external command
+   PHASE_FORK,     // fork of a built-in pipeline stage
+   PHASE_EXECUTE,  // a built-in running in the shell
+   PHASE_WAIT,     // waiting for a foreground child
+   PHASE_SWEEP,    // reaping finished jobs
+   PHASE_MAX
+  };
+  enum Kind {KIND_BUILTIN, KIND_EXTERNAL, KIND_SHELL, KIND_MAX};
+  class PhaseStats {
+   long long count;
+   long long total_ns;
+   long long max_ns;
+   long long buckets[STATS_BUCKETS];
+   public:
+   PhaseStats();
+   void record(long long ns);
+   long long GetCount();
+   long long GetTotalNs();
+   long long GetMaxNs();
+   long long GetBucket(int i);
+   long long percentileNs(double fraction); // upper bound of the bucket it falls in
+  };
+  private:
+  PhaseStats phases[PHASE_MAX][KIND_MAX];
+ public:
+  static const char* phaseName(Phase phase);
+  static const char* kindName(Kind kind);
+  void record(Phase phase, Kind kind, long long ns);
+  void reset();
+  void print(bool histograms);
+  void printJson(std::ostream& out);
+};
+
+// times a phase from construction until stop() or the end of the scope
+class PhaseTimer {
+  ShellStats::Phase phase;
+  ShellStats::Kind kind;
+  long long start;
+  bool stopped;
+ public:
+  PhaseTimer(ShellStats::Phase phase, ShellStats::Kind kind);
+  ~PhaseTimer();
+  void stop();
+};
+
+ShellStats::Kind _commandKind(Command* cmd);
+
+class StatsCommand : public BuiltInCommand {
+ public:
+  StatsCommand(const char* cmd_line);
+  virtual ~StatsCommand() {}
+  void execute() override;
+  bool isInShellPipeStage() override {return true;};
+};
+
+/* ---- TRACING ---- */
+
+// chrome trace-event json (the array format) of what the shell does: a span
+// per command line with its phases and pipeline stages nested under it, and
+// instants for stops, continues and timeout kills. opt in with --trace or the
+// trace builtin. events are buffered and written at the end of each line, so
+// a session cut short still loads (the closing ] is optional).
+class TraceLog {
+  int fd; // -1 when tracing is off
+  pid_t owner; // forked children inherit the log but never write it
+  std::string file;
+  std::string buffer;
+  void event(const char* name, const char* category, char type, long long ts_ns, pid_t tid);
+  void endEvent(const char* detail);
+ public:
+  TraceLog();
+  TraceLog(TraceLog const&) = delete;
+  void operator=(TraceLog const&) = delete;
+  ~TraceLog();
+  bool open(const std::string& file);
+  void close();
+  void flush();
+  bool isOn() {return fd != -1;};
+  const std::string& GetFile();
+  // a complete event; tid is the shell's pid for work done in the shell
+  void span(const char* name, const char* category, long long start_ns, long long end_ns, pid_t tid, const char* detail = NULL);
+  void instant(const char* name, const char* category, pid_t tid, const char* detail = NULL);
+};
+
+class TraceCommand : public BuiltInCommand {
+ public:
+  TraceCommand(const char* cmd_line);
+  virtual ~TraceCommand() {}
+  void execute() override;
+};
+
+/* ---- PLUGINS ---- */
+
+// built-ins loaded from shared objects with enable -f, by name
+class PluginList {
+  public:
+  class PluginEntry {
+   std::string file;
+   void* handle;
+   const struct smash_builtin* builtin;
+   BuiltinTable::Factory previous; // the built-in the plugin replaced, if any
+   public:
+   PluginEntry();
+   PluginEntry(std::string file, void* handle, const struct smash_builtin* builtin, BuiltinTable::Factory previous);
+   const std::string& GetFile();
+   void* GetHandle();
+   const struct smash_builtin* GetBuiltin();
+   BuiltinTable::Factory GetPrevious();
+  };
+  private:
+  std::unordered_map<std::string, PluginEntry> plugins;
+ public:
+  PluginList() = default;
+  PluginList(PluginList const&) = delete;
+  void operator=(PluginList const&) = delete;
+  ~PluginList();
+  bool load(const std::string& file, const std::string& name);
+  bool unload(const std::string& name);
+  const struct smash_builtin* find(const std::string& name); // NULL if not loaded
+  void printPlugins();
+};
+
+class PluginCommand : public BuiltInCommand {
+  const struct smash_builtin* builtin;
+ public:
+  PluginCommand(const char* cmd_line, const struct smash_builtin* builtin);
+  virtual ~PluginCommand() {}
+  void execute() override;
+  bool isInShellPipeStage() override {return true;};
+};
+
+class EnableCommand : public BuiltInCommand {
+ public:
+  EnableCommand(const char* cmd_line);
+  virtual ~EnableCommand() {}
+  void execute() override;
+};
+
 class SmallShell {
  private:
   SmallShell();
@@ -243,8 +899,23 @@ class SmallShell {
   std::string prev_pwd;
   JobsList jobs_list;
   TimesList times_list;
+  CgroupList cgroups;
+  AffinityList affinity;
+  LaunchPriority background_priority; // defaults for jobs started with &
+  PathCache path_cache;
+  PluginList plugins;
+  ShellStats stats;
+  TraceLog trace;
+  OutputBuffer output_buffer;
+  CommandArena command_arena; // the commands of the line being run
   Command* current_cmd;
   pid_t shell_pid;
+  int last_status; // exit code of the last foreground command
+  int epoll_fd;
+  int signal_fd;
+  int input_fd; // the input fd registered with epoll, -1 if none
+  void dispatchSignals();
+  void runCommand(const char* cmd_line);
  public:
   Command *CreateCommand(const char* cmd_line);
   SmallShell(SmallShell const&)      = delete; // disable copy ctor
@@ -256,17 +927,35 @@ class SmallShell {
     return instance;
   }
   ~SmallShell();
+  bool setupEvents();
+  int GetEventFd();
+  bool handleEvents(int timeout_ms);
+  void waitForInput(int fd);
+  pid_t waitForChild(pid_t pid, int *status, int options, struct rusage *usage = NULL);
   void executeCommand(const char* cmd_line);
+  pid_t launchPipeStage(Command *cmd, RedirectionList &redirections, int in_fd, int out_fd, int out_target, pid_t pgid, const std::vector<int>& pipe_fds);
+  void runPipeStageInShell(Command *cmd, RedirectionList &redirections, int in_fd, int out_fd, int out_target);
   void executePipeCommand(const char *cmd_line, string& type);
-  int prepareRedirectionCommand(char *cmd_line, string& type);
   bool GetRun();
   pid_t GetShellPid();
+  int GetLastStatus();
+  void SetLastStatus(int status);
   std::string& GetPrompt();
   std::string& GetPrev_pwd();
   JobsList& GetJobsListReference();
-  std::shared_ptr<JobsList> GetJobsList();
-  std::shared_ptr<TimesList> GetTimesList();
+  CommandArena& GetCommandArena();
+  std::shared_ptr<Command> promoteCommand(Command* cmd);
+  const char* expandAliases(const char* cmd_line);
   TimesList& GetTimesListReference();
+  CgroupList& GetCgroupListReference();
+  AffinityList& GetAffinityReference();
+  LaunchPriority& GetBackgroundPriorityReference();
+  PathCache& GetPathCacheReference();
+  PluginList& GetPluginListReference();
+  ShellStats& GetStatsReference();
+  TraceLog& GetTraceLogReference();
+  // a finished phase, into the stats and (when on) the trace
+  void recordPhase(ShellStats::Phase phase, ShellStats::Kind kind, long long start_ns, long long end_ns);
   Command* GetCommand();
   void SetCommand(Command* cmd_new);
   void RemoveFinishedJobs();
@@ -276,4 +965,23 @@ class SmallShell {
   void printJobsList();
 };
 
+// the factory behind REGISTER_BUILTIN: a T(cmd_line) in the line's arena
+template <class T> Command* _createBuiltin(const char* cmd_line)
+{
+  return SmallShell::getInstance().GetCommandArena().create<T>(cmd_line);
+}
+
+// adds a built-in to the dispatch table, next to its implementation:
+//   REGISTER_BUILTIN("pwd", PwdCommand);
+// commands whose constructor needs more than the line register a factory:
+//   REGISTER_BUILTIN_FACTORY("fg", _createForegroundCommand);
+// one type may be registered under several names. the registrar is named
+// after the line, so each goes on a line of its own
+#define _BUILTIN_CONCAT2(a, b) a##b
+#define _BUILTIN_CONCAT(a, b) _BUILTIN_CONCAT2(a, b)
+#define REGISTER_BUILTIN_FACTORY(name, factory) \
+  static BuiltinTable::Registrar _BUILTIN_CONCAT(_builtin_registrar_, __LINE__)(name, std::integral_constant<uint32_t, _hashName(name)>::value, &factory)
+#define REGISTER_BUILTIN(name, type) \
+  static BuiltinTable::Registrar _BUILTIN_CONCAT(_builtin_registrar_, __LINE__)(name, std::integral_constant<uint32_t, _hashName(name)>::value, &_createBuiltin<type>)
+
 #endif //SMASH_COMMAND_H_
\ No newline at end of file
@@ -0,0 +1,241 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "Commands.h"
+#include "signals.h"
+
+// microbenchmarks for the shell's hot paths.
+// usage: smash_bench [output.json] (default bench_output.json)
+
+#define BENCH_FILE "/tmp/smash_bench_data"
+#define BENCH_FILE_MB (64) // keep in sync with the head -c 64M pipeline
+
+using namespace std;
+
+static double nowSec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// stdout of the measured commands goes to /dev/null
+static int silence() {
+    cout.flush();
+    int saved = dup(1);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    close(null_fd);
+    return saved;
+}
+
+static void restore(int saved) {
+    cout.flush();
+    dup2(saved, 1);
+    close(saved);
+}
+
+class Results {
+    vector<string> entries;
+ public:
+    void add(const string& name, double value, const string& unit) {
+        ostringstream entry;
+        entry << "    {\"name\": \"" << name << "\", \"value\": " << value << ", \"unit\": \"" << unit << "\"}";
+        entries.push_back(entry.str());
+        cerr << name << ": " << value << " " << unit << endl;
+    }
+    bool write(const char* path) {
+        ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        out << "{\n  \"results\": [\n";
+        for (size_t i = 0; i < entries.size(); i++) {
+            out << entries[i] << (i + 1 < entries.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+        return true;
+    }
+};
+
+static double timeCommand(SmallShell& smash, const char* cmd_line, int iterations) {
+    int saved = silence();
+    double start = nowSec();
+    for (int i = 0; i < iterations; i++) {
+        smash.executeCommand(cmd_line);
+    }
+    double elapsed = nowSec() - start;
+    restore(saved);
+    return elapsed / iterations;
+}
+
+static void benchLaunch(SmallShell& smash, Results& results) {
+    results.add("launch.builtin.showpid", timeCommand(smash, "showpid", 2000) * 1e6, "us");
+    results.add("launch.builtin.pwd", timeCommand(smash, "pwd", 2000) * 1e6, "us");
+    results.add("launch.external.true", timeCommand(smash, "true", 200) * 1e6, "us");
+    results.add("launch.external.bash_fallback", timeCommand(smash, "true \"x\"", 200) * 1e6, "us");
+}
+
+static bool makeDataFile() {
+    int fd = open(BENCH_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("smash_bench: open failed");
+        return false;
+    }
+    vector<char> block(1 << 20, 'x');
+    for (int i = 0; i < BENCH_FILE_MB; i++) {
+        if (write(fd, block.data(), block.size()) != (ssize_t)block.size()) {
+            perror("smash_bench: write failed");
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+static void benchThroughput(SmallShell& smash, Results& results) {
+    if (!makeDataFile()) {
+        return;
+    }
+    double secs = timeCommand(smash, "cat " BENCH_FILE " > /dev/null", 5);
+    results.add("cat.to_devnull", BENCH_FILE_MB / secs, "MB/s");
+    secs = timeCommand(smash, "cat " BENCH_FILE " > " BENCH_FILE ".out", 5);
+    results.add("cat.to_file", BENCH_FILE_MB / secs, "MB/s");
+    secs = timeCommand(smash, "cat " BENCH_FILE " | wc -c", 5);
+    results.add("pipe.cat_wc", BENCH_FILE_MB / secs, "MB/s");
+    secs = timeCommand(smash, "head -c 64M /dev/zero | tr x y | wc -c", 5);
+    results.add("pipe.external_3_stage", BENCH_FILE_MB / secs, "MB/s");
+    unlink(BENCH_FILE);
+    unlink(BENCH_FILE ".out");
+}
+
+static void benchJobsList(Results& results, int num_jobs) {
+    JobsList jobs;
+    // pids far above pid_max, so nothing real is ever touched
+    const pid_t base_pid = 1 << 30;
+    string prefix = "jobs." + to_string(num_jobs) + ".";
+
+    double start = nowSec();
+    for (int i = 0; i < num_jobs; i++) {
+        jobs.addJob(shared_ptr<Command>(new ExternalCommand("sleep 100 &")), base_pid + i, i % 2 == 0);
+    }
+    results.add(prefix + "add", (nowSec() - start) / num_jobs * 1e9, "ns/op");
+
+    start = nowSec();
+    for (int i = 0; i < num_jobs; i++) {
+        jobs.getJobById((i * 7919) % num_jobs + 1);
+    }
+    results.add(prefix + "get_by_id", (nowSec() - start) / num_jobs * 1e9, "ns/op");
+
+    start = nowSec();
+    for (int i = 0; i < num_jobs; i++) {
+        jobs.getJobByPid(base_pid + (i * 7919) % num_jobs);
+    }
+    results.add(prefix + "get_by_pid", (nowSec() - start) / num_jobs * 1e9, "ns/op");
+
+    start = nowSec();
+    jobs.getLastStoppedJob();
+    results.add(prefix + "last_stopped", (nowSec() - start) * 1e9, "ns");
+
+    int saved = silence();
+    start = nowSec();
+    jobs.printJobsList();
+    double elapsed = nowSec() - start;
+    restore(saved);
+    results.add(prefix + "print", elapsed * 1e3, "ms");
+
+    start = nowSec();
+    for (int i = num_jobs; i > 0; i--) {
+        jobs.removeJobById(i);
+    }
+    results.add(prefix + "remove", (nowSec() - start) / num_jobs * 1e9, "ns/op");
+}
+
+// the sweep needs real children: num_children running jobs, timed with
+// nothing changed and with one of them just exited
+static void benchSweep(Results& results, int num_children) {
+    JobsList jobs;
+    vector<pid_t> pids;
+    for (int i = 0; i < num_children; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            pause();
+            _exit(0);
+        }
+        if (pid == -1) {
+            perror("smash_bench: fork failed");
+            break;
+        }
+        pids.push_back(pid);
+        jobs.addJob(shared_ptr<Command>(new ExternalCommand("sleep 100 &")), pid, false);
+    }
+    string prefix = "sweep." + to_string(pids.size()) + ".";
+    const int runs = 50;
+
+    double start = nowSec();
+    for (int i = 0; i < runs; i++) {
+        child_status_changed = 1;
+        jobs.removeFinishedJobs();
+    }
+    results.add(prefix + "idle", (nowSec() - start) / runs * 1e6, "us");
+
+    double total = 0;
+    int exited = 0;
+    for (size_t i = 0; i < pids.size() && exited < runs; i++, exited++) {
+        kill(pids[i], SIGKILL);
+        siginfo_t info;
+        waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT);
+        child_status_changed = 1;
+        start = nowSec();
+        jobs.removeFinishedJobs();
+        total += nowSec() - start;
+    }
+    if (exited > 0) {
+        results.add(prefix + "one_exited", total / exited * 1e6, "us");
+    }
+
+    for (size_t i = exited; i < pids.size(); i++) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], NULL, 0);
+    }
+}
+
+static void benchTimeout(SmallShell& smash, Results& results) {
+    const int runs = 5;
+    const double duration = 0.1;
+    double total_late = 0;
+    for (int i = 0; i < runs; i++) {
+        total_late += timeCommand(smash, "timeout 0.1 sleep 5", 1) - duration;
+    }
+    results.add("timeout.lateness", total_late / runs * 1e3, "ms");
+}
+
+int main(int argc, char* argv[]) {
+    const char* output = argc > 1 ? argv[1] : "bench_output.json";
+    SmallShell& smash = SmallShell::getInstance();
+    if (!smash.setupEvents()) {
+        return 1;
+    }
+    Results results;
+    benchLaunch(smash, results);
+    benchThroughput(smash, results);
+    benchJobsList(results, 10);
+    benchJobsList(results, 1000);
+    benchJobsList(results, 100000);
+    benchSweep(results, 10);
+    benchSweep(results, 1000);
+    benchTimeout(smash, results);
+    if (!results.write(output)) {
+        perror("smash_bench: writing results failed");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * basename as a smash built-in, an example of the plugin interface:
+ *   make plugins
+ *   enable -f plugins/basename.so basename
+ */
+#include <stdio.h>
+#include <string.h>
+#include "../smash_plugin.h"
+
+static int basename_run(int argc, char **argv)
+{
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "basename: usage: basename path [suffix]\n");
+    return 1;
+  }
+  const char *path = argv[1];
+  size_t end = strlen(path);
+  /* trailing slashes do not count, "/" stays "/" */
+  while (end > 1 && path[end - 1] == '/')
+    end--;
+  size_t start = end;
+  while (start > 0 && path[start - 1] != '/')
+    start--;
+  if (end == 1 && path[0] == '/')
+    start = 0;
+  size_t length = end - start;
+  if (argc == 3) {
+    size_t suffix_length = strlen(argv[2]);
+    if (suffix_length < length && strncmp(path + end - suffix_length, argv[2], suffix_length) == 0)
+      length -= suffix_length;
+  }
+  printf("%.*s\n", (int)length, path + start);
+  return 0;
+}
+
+SMASH_DEFINE_BUILTIN(basename, basename_run);
@@ -19,6 +19,11 @@
 
 using namespace std;
 
+volatile sig_atomic_t child_status_changed = 0;
+
+// the handlers run on the main flow, dispatched by SmallShell::handleEvents
+// from the signalfd and the timeout timerfd, so they may touch shell state.
+
 void ctrlZHandler(int sig_num) {
   cout<< "smash: got ctrl-Z" <<endl;
   SmallShell& smash = SmallShell::getInstance();
@@ -27,9 +32,15 @@ void ctrlZHandler(int sig_num) {
     return;
   }
   if (cmd->isForeground()){
-    DO_SYS(kill(cmd->GetPid() , SIGSTOP), "kill");
-    cout<< "smash: process " << cmd->GetPid() << " was stopped" <<endl;
     cmd->SetForeground(false);
+    vector<pid_t> pids = cmd->GetForegroundPids();
+    for (size_t i = 0; i < pids.size(); i++){
+      if (pids[i] <= 0)
+        continue;
+      DO_SYS(kill(pids[i], SIGSTOP), "kill");
+      cout<< "smash: process " << pids[i] << " was stopped" <<endl;
+      smash.GetTraceLogReference().instant("stop", "job", pids[i], cmd->GetCmd_line());
+    }
   }
 }
 
@@ -41,8 +52,14 @@ void ctrlCHandler(int sig_num) {
     return;
   }
   if (cmd->isForeground()){
-    DO_SYS(kill(cmd->GetPid(), SIGKILL), "kill");
-    cout<< "smash: process " << cmd->GetPid() << " was killed" <<endl;
+    cmd->SetForeground(false);
+    vector<pid_t> pids = cmd->GetForegroundPids();
+    for (size_t i = 0; i < pids.size(); i++){
+      if (pids[i] <= 0)
+        continue;
+      DO_SYS(kill(pids[i], SIGKILL), "kill");
+      cout<< "smash: process " << pids[i] << " was killed" <<endl;
+    }
   }
 }
 
@@ -51,4 +68,9 @@ void alarmHandler(int sig_num) {
   SmallShell& smash = SmallShell::getInstance();
   TimesList& times_ref = smash.GetTimesListReference();
   times_ref.killFinishedAlarms();
-}
\ No newline at end of file
+}
+
+void childHandler(int sig_num) {
+  // the jobs list is swept before the next command
+  child_status_changed = 1;
+}
@@ -1,8 +1,14 @@
 #ifndef SMASH__SIGNALS_H_
 #define SMASH__SIGNALS_H_
 
+#include <signal.h>
+
+// set by childHandler whenever a child exits, stops or continues
+extern volatile sig_atomic_t child_status_changed;
+
 void ctrlZHandler(int sig_num);
 void ctrlCHandler(int sig_num);
 void alarmHandler(int sig_num);
+void childHandler(int sig_num);
 
 #endif //SMASH__SIGNALS_H_
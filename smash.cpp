@@ -2,40 +2,127 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+#include <fstream>
+#include <stdlib.h>
 #include "Commands.h"
 #include "signals.h"
 
 #define RUN 1
+#define SCRIPT_BUFFER_SIZE (1 << 16)
 
-int main(int argc, char* argv[]) {
-    if(signal(SIGTSTP , ctrlZHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-Z handler");
+// splits input into lines through one large buffer. while it waits for more
+// input the shell keeps handling signals and timeouts.
+class LineReader {
+    int fd;
+    char buffer[SCRIPT_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+public:
+    explicit LineReader(int fd) : fd(fd), start(0), end(0) {}
+    bool next(SmallShell& smash, std::string& line) {
+        line.clear();
+        while (true) {
+            char* newline = (char*)memchr(buffer + start, '\n', end - start);
+            if (newline) {
+                line.append(buffer + start, newline - (buffer + start));
+                start = newline - buffer + 1;
+                return true;
+            }
+            line.append(buffer + start, end - start);
+            start = end = 0;
+            smash.waitForInput(fd);
+            ssize_t count = read(fd, buffer, SCRIPT_BUFFER_SIZE);
+            if (count == -1 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                // a last line without a newline still counts
+                return !line.empty();
+            }
+            end = count;
+        }
     }
-    if(signal(SIGINT , ctrlCHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
+};
+
+static void runCommandLine(SmallShell& smash, const char* cmd_line) {
+    // pick up anything that happened while the previous command ran
+    smash.handleEvents(0);
+    smash.RemoveFinishedJobs();
+    smash.executeCommand(cmd_line);
+}
+
+// with SMASH_STATS_FILE set, the stats builtin's json goes there at exit
+static void dumpStats(SmallShell& smash) {
+    const char* stats_file = getenv("SMASH_STATS_FILE");
+    if (!stats_file || !*stats_file) {
+        return;
     }
-    struct sigaction act={0};
-    // sigemptyset (&act.sa_mask);
-    act.sa_flags = SA_RESTART;
-    act.sa_handler = &alarmHandler;
-    if(sigaction(SIGALRM, &act, NULL) ==-1) {
-        perror("smash error: failed to set SigAlarm handler");
+    std::ofstream out(stats_file);
+    if (!out) {
+        perror("smash error: open failed");
+        return;
     }
+    smash.GetStatsReference().printJson(out);
+}
 
-    // alarm(1);
-
+int main(int argc, char* argv[]) {
     SmallShell& smash = SmallShell::getInstance();
+    if (!smash.setupEvents()) {
+        return 1;
+    }
+    // smash --trace out.json ...: trace the whole session, the rest of the
+    // arguments as usual
+    if (argc >= 3 && strcmp(argv[1], "--trace") == 0) {
+        if (!smash.GetTraceLogReference().open(argv[2])) {
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    // smash -c "cmd": run the given line(s) and exit
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        std::istringstream lines(argv[2]);
+        for (std::string cmd_line; smash.GetRun() == RUN && std::getline(lines, cmd_line);) {
+            runCommandLine(smash, cmd_line.c_str());
+        }
+        dumpStats(smash);
+        return smash.GetLastStatus();
+    }
+    // smash -f script: no prompt
+    int input_fd = 0;
+    bool interactive = true;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        input_fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+        if (input_fd == -1) {
+            perror("smash error: open failed");
+            return 1;
+        }
+        interactive = false;
+    }
+    else if (argc != 1) {
+        std::cerr << "usage: smash [--trace file] [-f script | -c command]" << std::endl;
+        return 1;
+    }
+
+    LineReader reader(input_fd);
+    std::string cmd_line;
     while(smash.GetRun() == RUN) {
-        std::cout << smash.GetPrompt();
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
-        smash.RemoveFinishedJobs();
-        smash.executeCommand(cmd_line.c_str());
-        if (smash.GetCommand())
-            smash.GetCommand()->SetForeground(false);
-        // cout << "bye" << endl;
-        // smash.RemoveFinishedJobs();
-        // smash.printJobsList();
-    }
-    return 0;
-}
\ No newline at end of file
+        if (interactive) {
+            std::cout << smash.GetPrompt() << std::flush;
+        }
+        if (!reader.next(smash, cmd_line)) {
+            break;
+        }
+        runCommandLine(smash, cmd_line.c_str());
+    }
+    if (input_fd != 0) {
+        close(input_fd);
+    }
+    dumpStats(smash);
+    return smash.GetLastStatus();
+}
@@ -0,0 +1,40 @@
+#ifndef SMASH_PLUGIN_H_
+#define SMASH_PLUGIN_H_
+
+/*
+ * The C interface of built-ins loaded at run time with
+ *   enable -f lib.so name
+ * The shared object exports one `const struct smash_builtin` called
+ * smash_builtin_<name>, best defined with SMASH_DEFINE_BUILTIN:
+ *
+ *   static int hello_run(int argc, char **argv) {
+ *     printf("hello %s\n", argc > 1 ? argv[1] : "world");
+ *     return 0;
+ *   }
+ *   SMASH_DEFINE_BUILTIN(hello, hello_run);
+ *
+ * run() is called inside the shell process with fds 0, 1 and 2 already
+ * redirected (files, pipes), so it reads and writes them like a program
+ * would, with read/write or stdio. argv is NULL terminated and argv[0] is
+ * the command name. the return value is the command's exit status.
+ * run() must not call exit() and must not keep argv after it returns.
+ */
+
+#define SMASH_PLUGIN_ABI_VERSION (1)
+
+struct smash_builtin {
+  int abi_version; /* SMASH_PLUGIN_ABI_VERSION the plugin was built against */
+  const char *name;
+  int (*run)(int argc, char **argv);
+};
+
+#ifdef __cplusplus
+#define SMASH_PLUGIN_EXTERN extern "C"
+#else
+#define SMASH_PLUGIN_EXTERN
+#endif
+
+#define SMASH_DEFINE_BUILTIN(name, run) \
+  SMASH_PLUGIN_EXTERN const struct smash_builtin smash_builtin_##name = {SMASH_PLUGIN_ABI_VERSION, #name, run}
+
+#endif //SMASH_PLUGIN_H_